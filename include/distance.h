@@ -0,0 +1,554 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef DISTANCE_H_
+#define DISTANCE_H_
+
+#include <cstdlib>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DISTANCE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/** Squared euclidean distance and box containment kernels over contiguous
+    coordinates, with vectorized versions selected at runtime for the
+    instruction sets the processor supports.
+
+    Points are dim consecutive Numbers; a block is count points one after
+    another.  Below cross_max_dim + 1 dimensions a point fills little of a
+    vector, so the block kernels work on several points at once, a
+    coordinate at a time, summing in the same order as the scalar kernel so
+    that they give the same results exactly.  Ranges are 2 * dim Numbers
+    holding the lower and upper bound of each coordinate in turn, as used
+    by KdTree::range_search.
+
+    The scalar kernels are used for any Number type, the vectorized ones
+    exist for float and double.
+*/
+template<class Number> struct DistanceKernels {
+
+    enum Isa {
+        SCALAR = 0,
+        SSE2,
+        AVX2,
+        AVX512
+    };
+
+    typedef Number (*DistanceFn)(const Number *a, const Number *b, size_t dim);
+    typedef void (*BlockFn)(const Number *q, const Number *block, size_t count,
+        size_t dim, Number *out);
+    typedef bool (*InRangeFn)(const Number *p, const Number *range, size_t dim);
+
+    /** Squared distance between two points. */
+    DistanceFn distance;
+
+    /** Squared distances between a point and each point of a block. */
+    BlockFn block_distance;
+
+    /** Whether a point lies within a range, bounds inclusive. */
+    InRangeFn in_range;
+
+    Isa isa;
+
+    /** The most dimensions for which the block kernels work across points. */
+    static const size_t cross_max_dim = 3;
+
+    /** The fewest dimensions for which best() chooses AVX-512, below which
+        its masked loads measured slower than AVX2.
+    */
+    static const size_t avx512_min_dim = 16;
+
+    /** Returns the kernels for the best instruction set this processor
+        supports for points of dim coordinates.  The choice is made once,
+        on first use.
+    */
+    static const DistanceKernels &best(size_t dim)
+    {
+        static const DistanceKernels wide = select(supported());
+        static const DistanceKernels narrow = select(supported() < AVX512
+            ? supported() : AVX2);
+        return dim >= avx512_min_dim ? wide : narrow;
+    }
+
+    /** Returns the most capable instruction set this processor supports. */
+    static Isa supported()
+    {
+        #ifdef DISTANCE_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) return AVX512;
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return AVX2;
+        if (__builtin_cpu_supports("sse2")) return SSE2;
+        #endif
+        return SCALAR;
+    }
+
+    /** Returns the kernels for a particular instruction set, which the caller
+        must know to be supported.  Falls back to the scalar kernels where no
+        vectorized version exists for Number.
+    */
+    static DistanceKernels select(Isa isa)
+    {
+        DistanceKernels k;
+        k.distance = scalar_distance;
+        k.block_distance = scalar_block;
+        k.in_range = scalar_in_range;
+        k.isa = SCALAR;
+
+        #ifdef DISTANCE_X86_KERNELS
+        Vectorized<Number>::select(isa, k);
+        #endif
+
+        return k;
+    }
+
+    static Number scalar_distance(const Number *a, const Number *b, size_t dim)
+    {
+        Number distance = 0;
+        for (size_t i = 0; i < dim; ++i) {
+            distance += (a[i] - b[i]) * (a[i] - b[i]);
+        }
+
+        return distance;
+    }
+
+    static void scalar_block(const Number *q, const Number *block, size_t count,
+        size_t dim, Number *out)
+    {
+        for (size_t j = 0; j < count; ++j, block += dim) {
+            out[j] = scalar_distance(q, block, dim);
+        }
+    }
+
+    static bool scalar_in_range(const Number *p, const Number *range, size_t dim)
+    {
+        for (size_t i = 0; i < dim; ++i) {
+            if (range[i*2] > p[i] || range[i*2+1] < p[i]) return false;
+        }
+
+        return true;
+    }
+
+private:
+
+    #ifdef DISTANCE_X86_KERNELS
+
+    //no vectorized kernels for other types
+    template<class T, class Dummy = void> struct Vectorized {
+        static void select(Isa, DistanceKernels &)
+        {
+        }
+    };
+
+    template<class Dummy> struct Vectorized<double, Dummy> {
+
+        static void select(Isa isa, DistanceKernels &k)
+        {
+            if (isa >= AVX512) {
+                k.distance = avx512_distance;
+                k.block_distance = avx512_block;
+                k.in_range = avx512_in_range;
+                k.isa = AVX512;
+            } else if (isa >= AVX2) {
+                k.distance = avx2_distance;
+                k.block_distance = avx2_block;
+                k.in_range = avx2_in_range;
+                k.isa = AVX2;
+            } else if (isa >= SSE2) {
+                k.distance = sse2_distance;
+                k.block_distance = sse2_block;
+                k.isa = SSE2;
+            }
+        }
+
+        __attribute__((target("sse2")))
+        static double sse2_distance(const double *a, const double *b, size_t dim)
+        {
+            __m128d acc = _mm_setzero_pd();
+            size_t i = 0;
+            for (; i + 2 <= dim; i += 2) {
+                __m128d d = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+                acc = _mm_add_pd(acc, _mm_mul_pd(d, d));
+            }
+
+            double distance = _mm_cvtsd_f64(_mm_add_sd(acc, _mm_unpackhi_pd(acc, acc)));
+            for (; i < dim; ++i) distance += (a[i] - b[i]) * (a[i] - b[i]);
+
+            return distance;
+        }
+
+        __attribute__((target("sse2")))
+        static void sse2_block(const double *q, const double *block, size_t count,
+            size_t dim, double *out)
+        {
+            size_t j = 0;
+            if (dim <= cross_max_dim) {
+                for (; j + 2 <= count; j += 2, block += 2 * dim) {
+                    __m128d acc = _mm_setzero_pd();
+                    for (size_t i = 0; i < dim; ++i) {
+                        __m128d d = _mm_sub_pd(_mm_set1_pd(q[i]),
+                            _mm_set_pd(block[dim + i], block[i]));
+                        acc = _mm_add_pd(acc, _mm_mul_pd(d, d));
+                    }
+                    _mm_storeu_pd(out + j, acc);
+                }
+            }
+
+            for (; j < count; ++j, block += dim) {
+                out[j] = dim <= cross_max_dim ? scalar_distance(q, block, dim)
+                    : sse2_distance(q, block, dim);
+            }
+        }
+
+        __attribute__((target("avx2,fma")))
+        static double avx2_distance(const double *a, const double *b, size_t dim)
+        {
+            __m256d acc = _mm256_setzero_pd();
+            size_t i = 0;
+            for (; i + 4 <= dim; i += 4) {
+                __m256d d = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+                acc = _mm256_fmadd_pd(d, d, acc);
+            }
+
+            __m128d s = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+            if (i + 2 <= dim) {
+                __m128d d = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+                s = _mm_fmadd_pd(d, d, s);
+                i += 2;
+            }
+
+            double distance = _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+            if (i < dim) distance += (a[i] - b[i]) * (a[i] - b[i]);
+
+            return distance;
+        }
+
+        __attribute__((target("avx2,fma")))
+        static void avx2_block(const double *q, const double *block, size_t count,
+            size_t dim, double *out)
+        {
+            if (dim <= cross_max_dim) return avx2_cross_block(q, block, count, dim, out);
+
+            for (size_t j = 0; j < count; ++j, block += dim) {
+                out[j] = avx2_distance(q, block, dim);
+            }
+        }
+
+        //four points at a time. without fma, so that nothing is contracted
+        //and the sums round as the scalar kernel's do. kept out of line, or
+        //the callers' fma would be used after all.
+        __attribute__((target("avx2"), noinline))
+        static void avx2_cross_block(const double *q, const double *block,
+            size_t count, size_t dim, double *out)
+        {
+            size_t j = 0;
+            for (; j + 4 <= count; j += 4, block += 4 * dim) {
+                __m256d acc = _mm256_setzero_pd();
+                for (size_t i = 0; i < dim; ++i) {
+                    __m256d d = _mm256_sub_pd(_mm256_set1_pd(q[i]),
+                        _mm256_set_pd(block[3 * dim + i], block[2 * dim + i],
+                            block[dim + i], block[i]));
+                    acc = _mm256_add_pd(acc, _mm256_mul_pd(d, d));
+                }
+                _mm256_storeu_pd(out + j, acc);
+            }
+
+            for (; j < count; ++j, block += dim) {
+                out[j] = scalar_distance(q, block, dim);
+            }
+        }
+
+        __attribute__((target("avx2,fma")))
+        static bool avx2_in_range(const double *p, const double *range, size_t dim)
+        {
+            //two coordinates at a time against their interleaved bounds
+            size_t i = 0;
+            for (; i + 2 <= dim; i += 2) {
+                __m256d c = _mm256_castpd128_pd256(_mm_loadu_pd(p + i));
+                c = _mm256_permute4x64_pd(c, 0x50);
+                __m256d r = _mm256_loadu_pd(range + i * 2);
+                __m256d ge = _mm256_cmp_pd(c, r, _CMP_GE_OQ);
+                __m256d le = _mm256_cmp_pd(c, r, _CMP_LE_OQ);
+                if (_mm256_movemask_pd(_mm256_blend_pd(ge, le, 0xA)) != 0xF) return false;
+            }
+
+            if (i < dim && (range[i*2] > p[i] || range[i*2+1] < p[i])) return false;
+
+            return true;
+        }
+
+        __attribute__((target("avx512f")))
+        static double avx512_distance(const double *a, const double *b, size_t dim)
+        {
+            __m512d acc = _mm512_setzero_pd();
+            size_t i = 0;
+            for (; i + 8 <= dim; i += 8) {
+                __m512d d = _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+                acc = _mm512_fmadd_pd(d, d, acc);
+            }
+
+            if (i < dim) {
+                __mmask8 m = (__mmask8)((1u << (dim - i)) - 1);
+                __m512d d = _mm512_sub_pd(_mm512_maskz_loadu_pd(m, a + i),
+                    _mm512_maskz_loadu_pd(m, b + i));
+                acc = _mm512_fmadd_pd(d, d, acc);
+            }
+
+            return _mm512_reduce_add_pd(acc);
+        }
+
+        __attribute__((target("avx512f")))
+        static void avx512_block(const double *q, const double *block, size_t count,
+            size_t dim, double *out)
+        {
+            //avx-512 always has fma, so the avx2 kernel keeps the sums exact
+            if (dim <= cross_max_dim) return avx2_cross_block(q, block, count, dim, out);
+
+            for (size_t j = 0; j < count; ++j, block += dim) {
+                out[j] = avx512_distance(q, block, dim);
+            }
+        }
+
+        __attribute__((target("avx512f")))
+        static bool avx512_in_range(const double *p, const double *range, size_t dim)
+        {
+            //four coordinates at a time against their interleaved bounds
+            const __m512i dup = _mm512_set_epi64(3, 3, 2, 2, 1, 1, 0, 0);
+            for (size_t i = 0; i < dim; i += 4) {
+                size_t left = dim - i < 4 ? dim - i : 4;
+                __mmask8 cm = (__mmask8)((1u << left) - 1);
+                __mmask8 rm = (__mmask8)((1u << (left * 2)) - 1);
+                __m512d c = _mm512_permutexvar_pd(dup, _mm512_maskz_loadu_pd(cm, p + i));
+                __m512d r = _mm512_maskz_loadu_pd(rm, range + i * 2);
+                __mmask8 ge = _mm512_cmp_pd_mask(c, r, _CMP_GE_OQ);
+                __mmask8 le = _mm512_cmp_pd_mask(c, r, _CMP_LE_OQ);
+                if ((((ge & 0x55) | (le & 0xAA)) & rm) != rm) return false;
+            }
+
+            return true;
+        }
+    };
+
+    template<class Dummy> struct Vectorized<float, Dummy> {
+
+        static void select(Isa isa, DistanceKernels &k)
+        {
+            if (isa >= AVX512) {
+                k.distance = avx512_distance;
+                k.block_distance = avx512_block;
+                k.in_range = avx512_in_range;
+                k.isa = AVX512;
+            } else if (isa >= AVX2) {
+                k.distance = avx2_distance;
+                k.block_distance = avx2_block;
+                k.in_range = avx2_in_range;
+                k.isa = AVX2;
+            } else if (isa >= SSE2) {
+                k.distance = sse2_distance;
+                k.block_distance = sse2_block;
+                k.isa = SSE2;
+            }
+        }
+
+        __attribute__((target("sse2")))
+        static float sse2_distance(const float *a, const float *b, size_t dim)
+        {
+            __m128 acc = _mm_setzero_ps();
+            size_t i = 0;
+            for (; i + 4 <= dim; i += 4) {
+                __m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+                acc = _mm_add_ps(acc, _mm_mul_ps(d, d));
+            }
+
+            acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+            acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+            float distance = _mm_cvtss_f32(acc);
+            for (; i < dim; ++i) distance += (a[i] - b[i]) * (a[i] - b[i]);
+
+            return distance;
+        }
+
+        __attribute__((target("sse2")))
+        static void sse2_block(const float *q, const float *block, size_t count,
+            size_t dim, float *out)
+        {
+            size_t j = 0;
+            if (dim <= cross_max_dim) {
+                for (; j + 4 <= count; j += 4, block += 4 * dim) {
+                    __m128 acc = _mm_setzero_ps();
+                    for (size_t i = 0; i < dim; ++i) {
+                        __m128 d = _mm_sub_ps(_mm_set1_ps(q[i]),
+                            _mm_set_ps(block[3 * dim + i], block[2 * dim + i],
+                                block[dim + i], block[i]));
+                        acc = _mm_add_ps(acc, _mm_mul_ps(d, d));
+                    }
+                    _mm_storeu_ps(out + j, acc);
+                }
+            }
+
+            for (; j < count; ++j, block += dim) {
+                out[j] = dim <= cross_max_dim ? scalar_distance(q, block, dim)
+                    : sse2_distance(q, block, dim);
+            }
+        }
+
+        __attribute__((target("avx2,fma")))
+        static float avx2_distance(const float *a, const float *b, size_t dim)
+        {
+            __m256 acc = _mm256_setzero_ps();
+            size_t i = 0;
+            for (; i + 8 <= dim; i += 8) {
+                __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+                acc = _mm256_fmadd_ps(d, d, acc);
+            }
+
+            __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+            if (i + 4 <= dim) {
+                __m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+                s = _mm_fmadd_ps(d, d, s);
+                i += 4;
+            }
+
+            s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+            s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+            float distance = _mm_cvtss_f32(s);
+            for (; i < dim; ++i) distance += (a[i] - b[i]) * (a[i] - b[i]);
+
+            return distance;
+        }
+
+        __attribute__((target("avx2,fma")))
+        static void avx2_block(const float *q, const float *block, size_t count,
+            size_t dim, float *out)
+        {
+            if (dim <= cross_max_dim) return avx2_cross_block(q, block, count, dim, out);
+
+            for (size_t j = 0; j < count; ++j, block += dim) {
+                out[j] = avx2_distance(q, block, dim);
+            }
+        }
+
+        //eight points at a time. without fma, so that nothing is contracted
+        //and the sums round as the scalar kernel's do. kept out of line, or
+        //the callers' fma would be used after all.
+        __attribute__((target("avx2"), noinline))
+        static void avx2_cross_block(const float *q, const float *block,
+            size_t count, size_t dim, float *out)
+        {
+            const __m256i stride = _mm256_mullo_epi32(
+                _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0), _mm256_set1_epi32(dim));
+
+            size_t j = 0;
+            for (; j + 8 <= count; j += 8, block += 8 * dim) {
+                __m256 acc = _mm256_setzero_ps();
+                for (size_t i = 0; i < dim; ++i) {
+                    __m256 d = _mm256_sub_ps(_mm256_set1_ps(q[i]),
+                        _mm256_i32gather_ps(block + i, stride, 4));
+                    acc = _mm256_add_ps(acc, _mm256_mul_ps(d, d));
+                }
+                _mm256_storeu_ps(out + j, acc);
+            }
+
+            for (; j < count; ++j, block += dim) {
+                out[j] = scalar_distance(q, block, dim);
+            }
+        }
+
+        __attribute__((target("avx2,fma")))
+        static bool avx2_in_range(const float *p, const float *range, size_t dim)
+        {
+            //four coordinates at a time against their interleaved bounds
+            const __m256i dup = _mm256_set_epi32(3, 3, 2, 2, 1, 1, 0, 0);
+            size_t i = 0;
+            for (; i + 4 <= dim; i += 4) {
+                __m256 c = _mm256_castps128_ps256(_mm_loadu_ps(p + i));
+                c = _mm256_permutevar8x32_ps(c, dup);
+                __m256 r = _mm256_loadu_ps(range + i * 2);
+                __m256 ge = _mm256_cmp_ps(c, r, _CMP_GE_OQ);
+                __m256 le = _mm256_cmp_ps(c, r, _CMP_LE_OQ);
+                if (_mm256_movemask_ps(_mm256_blend_ps(ge, le, 0xAA)) != 0xFF) return false;
+            }
+
+            for (; i < dim; ++i) {
+                if (range[i*2] > p[i] || range[i*2+1] < p[i]) return false;
+            }
+
+            return true;
+        }
+
+        __attribute__((target("avx512f")))
+        static float avx512_distance(const float *a, const float *b, size_t dim)
+        {
+            __m512 acc = _mm512_setzero_ps();
+            size_t i = 0;
+            for (; i + 16 <= dim; i += 16) {
+                __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+                acc = _mm512_fmadd_ps(d, d, acc);
+            }
+
+            if (i < dim) {
+                __mmask16 m = (__mmask16)((1u << (dim - i)) - 1);
+                __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i),
+                    _mm512_maskz_loadu_ps(m, b + i));
+                acc = _mm512_fmadd_ps(d, d, acc);
+            }
+
+            return _mm512_reduce_add_ps(acc);
+        }
+
+        __attribute__((target("avx512f")))
+        static void avx512_block(const float *q, const float *block, size_t count,
+            size_t dim, float *out)
+        {
+            //avx-512 always has fma, so the avx2 kernel keeps the sums exact
+            if (dim <= cross_max_dim) return avx2_cross_block(q, block, count, dim, out);
+
+            for (size_t j = 0; j < count; ++j, block += dim) {
+                out[j] = avx512_distance(q, block, dim);
+            }
+        }
+
+        __attribute__((target("avx512f")))
+        static bool avx512_in_range(const float *p, const float *range, size_t dim)
+        {
+            //eight coordinates at a time against their interleaved bounds
+            const __m512i dup = _mm512_set_epi32(7, 7, 6, 6, 5, 5, 4, 4,
+                3, 3, 2, 2, 1, 1, 0, 0);
+            for (size_t i = 0; i < dim; i += 8) {
+                size_t left = dim - i < 8 ? dim - i : 8;
+                __mmask16 cm = (__mmask16)((1u << left) - 1);
+                __mmask16 rm = (__mmask16)((1u << (left * 2)) - 1);
+                __m512 c = _mm512_permutexvar_ps(dup, _mm512_maskz_loadu_ps(cm, p + i));
+                __m512 r = _mm512_maskz_loadu_ps(rm, range + i * 2);
+                __mmask16 ge = _mm512_cmp_ps_mask(c, r, _CMP_GE_OQ);
+                __mmask16 le = _mm512_cmp_ps_mask(c, r, _CMP_LE_OQ);
+                if ((((ge & 0x5555) | (le & 0xAAAA)) & rm) != rm) return false;
+            }
+
+            return true;
+        }
+    };
+
+    #endif
+};
+
+#endif
@@ -0,0 +1,522 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef DYNAMIC_KD_TREE_H_
+#define DYNAMIC_KD_TREE_H_
+
+#include <vector>
+
+#include "kdtree.h"
+
+/** A set of points supporting insertion and deletion, kept as a logarithmic
+    forest of static kd-trees (Bentley and Saxe).
+
+    New points go into a small buffer which is scanned linearly.  When the
+    buffer fills it is merged, together with the smallest levels, into the
+    first level large enough to hold them all, level i holding up to
+    buffer_size * 4^i points, so each point is rebuilt into O(log n) trees
+    over its lifetime.  Every query searches each level, so levels grow by
+    four rather than two to halve their number, which costs a little more
+    rebuilding on insert.  Erased points are marked dead and skipped by queries,
+    and a level is rebuilt without them once half its points are dead.
+
+    Points are identified by the id returned from insert(), which queries
+    report.  The ids of erased points may be reused.  Point must be default
+    constructible and writable through operator[].
+
+    Queries are const and may run concurrently with each other, but not
+    with insert() or erase().
+*/
+template<class Point, class Number, size_t Dim = 0> class DynamicKdTree {
+
+public:
+
+    /** A stored point and its id.  These are what the static trees index. */
+    struct Entry {
+        Point pt;
+        size_t id;
+
+        Number &operator[](size_t i)
+        {
+            return pt[i];
+        }
+
+        Number operator[](size_t i) const
+        {
+            return pt[i];
+        }
+    };
+
+    typedef KdTree<Entry, Number, Dim> Tree;
+    typedef typename Tree::Options Options;
+
+    /** Creates an empty set.
+
+        \param dim The dimension of the points.
+        \param options How to build the static tree of each level.
+        \param buffer_size The number of points inserted before the buffer
+                           is merged into a tree.
+    */
+    DynamicKdTree(size_t dim, const Options &options = Options(),
+        size_t buffer_size = 256)
+        : dim(Dim ? Dim : dim)
+        , options(options)
+        , buffer_size(std::max<size_t>(buffer_size, 1))
+        , alive(0)
+    {
+    }
+
+    virtual ~DynamicKdTree()
+    {
+        for (size_t i = 0; i < levels.size(); ++i) {
+            delete levels[i]->tree;
+            delete levels[i];
+        }
+    }
+
+    /** Returns the number of points in the set. */
+    size_t size() const
+    {
+        return alive;
+    }
+
+    /** Adds a point to the set.
+
+        \param pt The point to add.
+        \return The id by which queries report the point.
+    */
+    size_t insert(const Point &pt)
+    {
+        size_t id;
+        if (free_ids.empty()) {
+            id = location.size();
+            location.push_back(IN_BUFFER);
+        } else {
+            id = free_ids.back();
+            free_ids.pop_back();
+            location[id] = IN_BUFFER;
+        }
+
+        buffer.push_back(Entry());
+        for (size_t d = 0; d < dim; ++d) buffer.back().pt[d] = pt[d];
+        buffer.back().id = id;
+
+        ++alive;
+
+        if (buffer.size() >= buffer_size) flush();
+
+        return id;
+    }
+
+    /** Removes a point from the set.
+
+        \param id The id returned when the point was inserted.
+        \return Whether the point was in the set.
+    */
+    bool erase(size_t id)
+    {
+        if (id >= location.size() || location[id] < IN_BUFFER) return false;
+
+        --alive;
+
+        if (location[id] == IN_BUFFER) {
+            for (size_t i = 0; i < buffer.size(); ++i) {
+                if (buffer[i].id == id) {
+                    buffer[i] = buffer.back();
+                    buffer.pop_back();
+                    break;
+                }
+            }
+
+            release(id);
+            return true;
+        }
+
+        //leave a tombstone, and compact the level once it is half dead
+        int index = location[id];
+        Level *level = levels[index];
+        location[id] = ERASED;
+        ++level->dead;
+
+        if (level->dead * 2 > level->entries.size()) {
+            std::vector<Entry> entries;
+            gather(level, entries);
+            rebuild(index, entries);
+        }
+
+        return true;
+    }
+
+    /** This function searches for the k nearest neighbours to a query point
+        across every level, sharing the bound from the neighbours found so
+        far between them.
+
+        \param k The number of nearest neighbours to find.
+        \param pt The point for which to find the nearest neighbour.
+        \param eps The epsilon for approximate nearest neighbour searches.
+        \return A list containing the ids and squared distances of the k
+                nearest neighbours to the query point.
+    */
+    std::list<std::pair<size_t, Number> > knn(size_t k, const Point &pt, Number eps) const
+    {
+        std::list<std::pair<size_t, Number> > qr;
+        if (k == 0) return qr;
+
+        Entry query;
+        for (size_t d = 0; d < dim; ++d) query.pt[d] = pt[d];
+
+        TopK<Entry *> pq(k);
+
+        //largest levels first, as they most likely hold the neighbours
+        typename Tree::SearchContext ctx(alive);
+        Alive filter(location);
+        for (size_t i = levels.size(); i-- > 0; ) {
+            if (levels[i]->tree) {
+                levels[i]->tree->knn_accumulate(ctx, pq, query, eps, filter);
+            }
+        }
+
+        for (size_t i = 0; i < buffer.size(); ++i) {
+            Number distance = this->distance(buffer[i], query);
+
+            if (!pq.full() || distance < pq.peek().priority) {
+                pq.push(distance, const_cast<Entry *>(&buffer[i]));
+            }
+        }
+
+        while (pq.length) {
+            typename TopK<Entry *>::Entry e = pq.pop();
+            qr.push_front(std::make_pair(e.data->id, (Number)e.priority));
+        }
+
+        return qr;
+    }
+
+    /** Calls visitor(size_t id) once for each point within an axis aligned
+        box, in no particular order.
+
+        \param range The box, as a lower and upper bound for each dimension.
+        \param visitor The function object to call for each point.
+    */
+    template<class Visitor> void range_visit(Number *range, Visitor &visitor) const
+    {
+        AliveVisitor<Visitor> alive_visitor(location, visitor);
+        for (size_t i = 0; i < levels.size(); ++i) {
+            if (levels[i]->tree) levels[i]->tree->range_visit(range, alive_visitor);
+        }
+
+        for (size_t i = 0; i < buffer.size(); ++i) {
+            if (in_range(buffer[i], range)) visitor(buffer[i].id);
+        }
+    }
+
+    /** Returns the ids of the points within an axis aligned box.
+
+        \param range The box, as a lower and upper bound for each dimension.
+    */
+    std::vector<size_t> range_search(Number *range) const
+    {
+        std::vector<size_t> qr;
+        Appender appender(qr);
+        range_visit(range, appender);
+
+        return qr;
+    }
+
+    /** Returns the number of points within an axis aligned box.  Levels
+        without dead points are counted using their subtree sizes.
+
+        \param range The box, as a lower and upper bound for each dimension.
+    */
+    size_t range_count(Number *range) const
+    {
+        size_t count = 0;
+
+        Counter counter(count);
+        AliveVisitor<Counter> alive_counter(location, counter);
+        for (size_t i = 0; i < levels.size(); ++i) {
+            if (!levels[i]->tree) continue;
+
+            if (levels[i]->dead) {
+                levels[i]->tree->range_visit(range, alive_counter);
+            } else {
+                count += levels[i]->tree->range_count(range);
+            }
+        }
+
+        for (size_t i = 0; i < buffer.size(); ++i) {
+            if (in_range(buffer[i], range)) ++count;
+        }
+
+        return count;
+    }
+
+    /** Calls visitor(size_t id) once for each point within distance r of a
+        point, in no particular order.
+
+        \param pt The centre of the ball.
+        \param r The radius of the ball.  Points at exactly r are included.
+        \param visitor The function object to call for each point.
+    */
+    template<class Visitor> void radius_visit(const Point &pt, Number r,
+        Visitor &visitor) const
+    {
+        Entry query;
+        for (size_t d = 0; d < dim; ++d) query.pt[d] = pt[d];
+
+        AliveVisitor<Visitor> alive_visitor(location, visitor);
+        for (size_t i = 0; i < levels.size(); ++i) {
+            if (levels[i]->tree) levels[i]->tree->radius_visit(query, r, alive_visitor);
+        }
+
+        for (size_t i = 0; i < buffer.size(); ++i) {
+            if (distance(buffer[i], query) <= r * r) visitor(buffer[i].id);
+        }
+    }
+
+    /** Returns the ids of the points within distance r of a point.
+
+        \param pt The centre of the ball.
+        \param r The radius of the ball.  Points at exactly r are included.
+    */
+    std::vector<size_t> radius_search(const Point &pt, Number r) const
+    {
+        std::vector<size_t> qr;
+        Appender appender(qr);
+        radius_visit(pt, r, appender);
+
+        return qr;
+    }
+
+    /** Returns the number of points within distance r of a point.  Levels
+        without dead points are counted using their subtree sizes.
+
+        \param pt The centre of the ball.
+        \param r The radius of the ball.  Points at exactly r are included.
+    */
+    size_t radius_count(const Point &pt, Number r) const
+    {
+        Entry query;
+        for (size_t d = 0; d < dim; ++d) query.pt[d] = pt[d];
+
+        size_t count = 0;
+
+        Counter counter(count);
+        AliveVisitor<Counter> alive_counter(location, counter);
+        for (size_t i = 0; i < levels.size(); ++i) {
+            if (!levels[i]->tree) continue;
+
+            if (levels[i]->dead) {
+                levels[i]->tree->radius_visit(query, r, alive_counter);
+            } else {
+                count += levels[i]->tree->radius_count(query, r);
+            }
+        }
+
+        for (size_t i = 0; i < buffer.size(); ++i) {
+            if (distance(buffer[i], query) <= r * r) ++count;
+        }
+
+        return count;
+    }
+
+private:
+
+    //location of an id: a level index, or one of these
+    enum {
+        IN_BUFFER = -1,
+        ERASED = -2,
+        FREE = -3
+    };
+
+    struct Level {
+
+        Level() : tree(0), dead(0)
+        {
+        }
+
+        std::vector<Entry> entries;
+        Tree *tree;
+        size_t dead;
+    };
+
+    struct Alive {
+
+        Alive(const std::vector<int> &location) : location(location)
+        {
+        }
+
+        bool operator()(const Entry *e) const
+        {
+            return location[e->id] != ERASED;
+        }
+
+        const std::vector<int> &location;
+    };
+
+    template<class Visitor> struct AliveVisitor {
+
+        AliveVisitor(const std::vector<int> &location, Visitor &visitor)
+            : location(location)
+            , visitor(visitor)
+        {
+        }
+
+        void operator()(Entry *e)
+        {
+            if (location[e->id] != ERASED) visitor(e->id);
+        }
+
+        const std::vector<int> &location;
+        Visitor &visitor;
+    };
+
+    struct Appender {
+
+        Appender(std::vector<size_t> &qr) : qr(qr)
+        {
+        }
+
+        void operator()(size_t id)
+        {
+            qr.push_back(id);
+        }
+
+        std::vector<size_t> &qr;
+    };
+
+    struct Counter {
+
+        Counter(size_t &count) : count(count)
+        {
+        }
+
+        void operator()(size_t)
+        {
+            ++count;
+        }
+
+        size_t &count;
+    };
+
+    size_t dim;
+    Options options;
+    size_t buffer_size;
+    size_t alive;
+
+    std::vector<Entry> buffer;
+    std::vector<Level *> levels;
+
+    //where each id lives, and ids free for reuse
+    std::vector<int> location;
+    std::vector<size_t> free_ids;
+
+    size_t capacity(size_t level) const
+    {
+        return buffer_size << (2 * level);
+    }
+
+    Number distance(const Entry &a, const Entry &b) const
+    {
+        Number distance = 0;
+        for (size_t d = 0; d < dim; ++d) distance += (a[d] - b[d]) * (a[d] - b[d]);
+
+        return distance;
+    }
+
+    bool in_range(const Entry &e, Number *range) const
+    {
+        for (size_t d = 0; d < dim; ++d) {
+            if (range[d*2] > e[d] || range[d*2+1] < e[d]) return false;
+        }
+
+        return true;
+    }
+
+    void release(size_t id)
+    {
+        location[id] = FREE;
+        free_ids.push_back(id);
+    }
+
+    //moves the live entries of a level to entries and empties it
+    void gather(Level *level, std::vector<Entry> &entries)
+    {
+        for (size_t i = 0; i < level->entries.size(); ++i) {
+            Entry &e = level->entries[i];
+            if (location[e.id] == ERASED) {
+                release(e.id);
+            } else {
+                entries.push_back(e);
+            }
+        }
+
+        delete level->tree;
+        level->tree = 0;
+        level->entries.clear();
+        level->dead = 0;
+    }
+
+    //merges the buffer and the smallest levels into the first level which
+    //can hold all of them
+    void flush()
+    {
+        std::vector<Entry> entries;
+        entries.swap(buffer);
+
+        size_t total = entries.size();
+        size_t target = 0;
+        while (1) {
+            if (target == levels.size()) levels.push_back(new Level);
+
+            total += levels[target]->entries.size() - levels[target]->dead;
+            if (total <= capacity(target)) break;
+
+            ++target;
+        }
+
+        entries.reserve(total);
+        for (size_t i = 0; i <= target; ++i) gather(levels[i], entries);
+
+        rebuild(target, entries);
+    }
+
+    void rebuild(size_t index, std::vector<Entry> &entries)
+    {
+        Level *level = levels[index];
+        level->entries.swap(entries);
+
+        for (size_t i = 0; i < level->entries.size(); ++i) {
+            location[level->entries[i].id] = index;
+        }
+
+        if (!level->entries.empty()) {
+            level->tree = new Tree(dim, &level->entries[0],
+                level->entries.size(), options);
+        }
+    }
+
+    DynamicKdTree(const DynamicKdTree &);
+    void operator=(const DynamicKdTree &);
+};
+
+#endif
@@ -48,11 +48,11 @@ public:
     void push(double priority, const T &data)
     {
 
-        //avoid duplicates. this obviously isn't very efficient, but it is
-        //still faster than using a std::set for typical sizes.
-        //this should be replaced with a custom hash table.
-        for (int i = 1; i <= length; ++i) {
-            if (entries[i].priority == priority) {
+        //avoid duplicates, which a search seeded with candidates finds
+        //again. entries are compared by data, as distinct entries may well
+        //have equal priorities.
+        for (size_t i = 1; i <= length; ++i) {
+            if (entries[i].data == data) {
                 return;
             }
         }
@@ -100,6 +100,11 @@ public:
         return length == size;
     }
 
+    size_t capacity() const
+    {
+        return size;
+    }
+
     size_t length;
 
 private:
@@ -26,50 +26,592 @@ THE SOFTWARE.
 #include <cmath>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 
+#include <algorithm>
 #include <limits>
 #include <list>
 #include <vector>
 
+#include <fcntl.h>
+#include <sched.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
+#include "distance.h"
 #include "fixed_size_priority_queue.h"
 #include "priority_queue.h"
+#include "thread_pool.h"
+#include "top_k.h"
 
-template<class Point, class Number> class KdTree {
+/** A kd-tree over an array of Points with coordinates of type Number.
+
+    If Dim is nonzero the tree only handles points of that dimension, and
+    the coordinate loops and per-query scratch space are sized at compile
+    time; the dim passed to the constructor must then equal Dim.  With the
+    default of 0 the dimension is taken from the constructor.
+*/
+template<class Point, class Number, size_t Dim = 0> class KdTree {
 
 public:
 
+    /** Orders in which knn searches visit the cells of the tree. */
+    enum KnnTraversal {
+        /** Choose from k, epsilon and the dimension of the tree. */
+        KNN_AUTO,
+
+        /** Nearest cell first, from a priority queue of the cells not yet
+            searched.  Reaches the neighbours in the fewest cells, and
+            approximate searches can stop as soon as the nearest remaining
+            cell is far enough away.
+        */
+        KNN_BEST_FIRST,
+
+        /** Down to the leaf holding the query and then back up, searching
+            the far child of each branch on the way from a stack no deeper
+            than the tree.  May visit a few more cells than best first, but
+            with no heap to maintain, each costs less.
+        */
+        KNN_DEPTH_FIRST
+    };
+
+    /** A node of the tree.  Branch nodes hold the median point of their
+        subtree, leaves hold a bucket of up to Options::bucket_size points
+        stored contiguously from pt().
+    */
     struct Node {
-        Point *pt;
+        //offset in bytes from this node to its first point. like the child
+        //links this is relative, so a tree can be mapped at any address.
+        long pt_offset;
+
+        //offsets in nodes from this node to its children, or 0 if absent.
+        //in preorder the left child is always the next node. these are as
+        //wide as a pointer, as a right child in a tree of billions of
+        //points is easily more than 2^31 nodes away.
+        long left_offset, right_offset;
+
+        //number of points in the subtree rooted here
+        size_t count;
+
         Number median;
-        Node *children;
+
+        //bounds of this node's cell along axis, from which knn searches
+        //update the distance to a child's cell incrementally
+        Number lo, hi;
+
         int axis;
 
+        //number of points held by this node itself: a bucket for leaves,
+        //the splitting point for internal nodes
+        inline size_t stored() const
+        {
+            return leaf() ? count : 1;
+        }
+
+        inline bool leaf() const
+        {
+            return !(left_offset | right_offset);
+        }
+
+        inline Point *pt() const
+        {
+            return (Point *)((char *)this + pt_offset);
+        }
+
+        inline void set_pt(Point *p)
+        {
+            pt_offset = (char *)p - (char *)this;
+        }
+
         inline Node *left()
         {
-            return (long)children & 0xA0000000 ? this + 1 : 0;
+            return left_offset ? this + left_offset : 0;
         }
 
         inline Node *right()
         {
-            Node *n = this + ((long)children & ~0xA0000000);
-            return this == n ? 0 : n;
+            return right_offset ? this + right_offset : 0;
+        }
+    };
+
+    //a node is three offsets, the count, three Numbers and the axis: 64
+    //bytes for double, a whole cache line. this fails to compile if the
+    //node grows past that, so that any growth is deliberate.
+    typedef char node_size_check[sizeof(Node) <= 4 * sizeof(long)
+        + 4 * sizeof(Number) ? 1 : -1];
+
+    /** Counts of the work done by queries, for tuning k, eps and the bucket
+        size against real queries.  A query given one adds its work to it,
+        so a SearchStats must not be shared by concurrent queries.
+    */
+    struct SearchStats {
+
+        SearchStats()
+        {
+            clear();
+        }
+
+        void clear()
+        {
+            for (size_t i = 0; i < counters; ++i) this->*counter(i) = 0;
+        }
+
+        /** Adds the counts of other to these, keeping the larger peak. */
+        void add(const SearchStats &other)
+        {
+            for (size_t i = 0; i < counters; ++i) this->*counter(i) += other.*counter(i);
+            queue_peak = std::max(queue_peak, other.queue_peak);
+        }
+
+        void queue_length(size_t length)
+        {
+            if (length > queue_peak) queue_peak = length;
+        }
+
+        /** Nodes whose points were examined. */
+        size_t nodes_visited;
+
+        /** Points whose distance from the query was computed, or which were
+            tested against the box of a range query.
+        */
+        size_t distances;
+
+        /** Cells added to and taken from the knn search queue, or the
+            stack of a depth first knn search.
+        */
+        size_t queue_pushes, queue_pops;
+
+        /** The longest the knn search queue or stack grew. */
+        size_t queue_peak;
+
+        /** Subtrees skipped because their cells could not hold a result,
+            including those still queued when a knn search finishes.
+        */
+        size_t pruned;
+
+        /** Subtrees of range and radius queries whose cells lay entirely
+            inside the query, so were reported or counted without testing
+            their points.
+        */
+        size_t contained;
+
+        /** Subtrees of range and radius queries whose cells crossed the
+            boundary of the query, so were descended into.
+        */
+        size_t intersected;
+
+        static const size_t counters = 8;
+
+        /** The counters in the order above, for iterating over them. */
+        static size_t SearchStats::*counter(size_t i)
+        {
+            static size_t SearchStats::*const members[counters] = {
+                &SearchStats::nodes_visited, &SearchStats::distances,
+                &SearchStats::queue_pushes, &SearchStats::queue_pops,
+                &SearchStats::queue_peak, &SearchStats::pruned,
+                &SearchStats::contained, &SearchStats::intersected
+            };
+            return members[i];
+        }
+
+        static const char *counter_name(size_t i)
+        {
+            static const char *const names[counters] = {
+                "nodes_visited", "distances", "queue_pushes", "queue_pops",
+                "queue_peak", "pruned", "contained", "intersected"
+            };
+            return names[i];
+        }
+    };
+
+    /** The distribution over many queries of each counter of SearchStats,
+        in power of two buckets: bucket 0 holds the queries for which the
+        counter was 0, and bucket b > 0 those for which it was in
+        [2^(b-1), 2^b).  Histograms of different threads can be merged.
+    */
+    struct SearchHistogram {
+
+        static const size_t buckets = 8 * sizeof(size_t) + 1;
+
+        SearchHistogram() : queries(0)
+        {
+            for (size_t i = 0; i < SearchStats::counters; ++i) {
+                std::fill(counts[i], counts[i] + buckets, 0);
+            }
+            total.clear();
+        }
+
+        /** Adds the counts of one query. */
+        void add(const SearchStats &stats)
+        {
+            ++queries;
+            total.add(stats);
+
+            for (size_t i = 0; i < SearchStats::counters; ++i) {
+                ++counts[i][bucket(stats.*SearchStats::counter(i))];
+            }
+        }
+
+        void merge(const SearchHistogram &other)
+        {
+            queries += other.queries;
+            total.add(other.total);
+
+            for (size_t i = 0; i < SearchStats::counters; ++i) {
+                for (size_t b = 0; b < buckets; ++b) counts[i][b] += other.counts[i][b];
+            }
+        }
+
+        /** The mean of a counter over the queries added. */
+        double mean(size_t counter) const
+        {
+            return queries ? (double)(total.*SearchStats::counter(counter)) / queries : 0;
+        }
+
+        /** An upper bound on the q quantile of a counter, 0 <= q <= 1: the
+            largest value of the bucket holding it.
+        */
+        size_t quantile(size_t counter, double q) const
+        {
+            size_t rank = (size_t)(q * queries), seen = 0;
+            for (size_t b = 0; b < buckets; ++b) {
+                seen += counts[counter][b];
+                if (seen > rank || seen == queries) return b ? ((size_t)2 << (b - 1)) - 1 : 0;
+            }
+            return 0;
+        }
+
+        static size_t bucket(size_t value)
+        {
+            size_t b = 0;
+            for (; value; value >>= 1) ++b;
+            return b;
+        }
+
+        /** The number of queries added. */
+        size_t queries;
+
+        /** The sums of the counters over the queries, with the largest peak. */
+        SearchStats total;
+
+        /** The number of queries in each bucket of each counter. */
+        size_t counts[SearchStats::counters][buckets];
+    };
+
+    /** Per-query scratch state.  Queries on a KdTree are const and keep
+        all of their working storage here, so any number of threads can
+        search a single shared tree as long as each uses its own context.
+        A context may be reused for any number of queries on the same thread.
+    */
+    struct SearchContext {
+
+        SearchContext(size_t n = 0)
+            : searchpq(std::max(32, (int)log(n + 1)))
+            , query(0)
+            , query_size(0)
+            , distances(0)
+            , distances_size(0)
+            , stack(0)
+            , stack_size(0)
+            , stats(0)
+            , traversal(KNN_AUTO)
+        {
+        }
+
+        virtual ~SearchContext()
+        {
+            delete[] query;
+            delete[] distances;
+            delete[] stack;
+        }
+
+        /** Copies a query point into contiguous scratch storage. */
+        const Number *load_query(const Point &pt, size_t dim)
+        {
+            if (query_size < dim) {
+                delete[] query;
+                query = new Number[dim];
+                query_size = dim;
+            }
+
+            for (size_t i = 0; i < dim; ++i) query[i] = pt[i];
+
+            return query;
+        }
+
+        /** Returns scratch storage for the distances to a bucket of points. */
+        Number *distance_buffer(size_t count)
+        {
+            if (distances_size < count) {
+                delete[] distances;
+                distances = new Number[count];
+                distances_size = count;
+            }
+
+            return distances;
+        }
+
+        /** A cell deferred by a depth first knn search. */
+        struct Frame {
+            Node *node;
+            Number distance;
+        };
+
+        /** Returns scratch storage for the stack of a depth first search. */
+        Frame *stack_buffer(size_t count)
+        {
+            if (stack_size < count) {
+                delete[] stack;
+                stack = new Frame[count];
+                stack_size = count;
+            }
+
+            return stack;
+        }
+
+        PriorityQueue<Node *> searchpq;
+
+        Number *query;
+        size_t query_size;
+
+        Number *distances;
+        size_t distances_size;
+
+        Frame *stack;
+        size_t stack_size;
+
+        /** If set, knn searches using this context add their work here. */
+        SearchStats *stats;
+
+        /** How knn searches using this context traverse the tree. */
+        KnnTraversal traversal;
+
+    private:
+
+        SearchContext(const SearchContext &);
+        void operator=(const SearchContext &);
+    };
+
+    /** State carried from one knn search to the next through a stream of
+        nearby queries, such as the positions along a trajectory.  A search
+        of the tree keeps more candidates than the k neighbours asked for,
+        and no other point can be nearer the query than the furthest of
+        them.  Later queries re-score the candidates, and while the k
+        nearest are closer than any other point could have come by the
+        distance the query has moved, they are the neighbours and the tree
+        is not searched at all.  Otherwise the tree is searched again,
+        bounded from the start by the candidates while the query is still
+        within their reach.  Results are as exact as those of a cold
+        search.  A cursor must not be shared by concurrent queries.
+    */
+    class KnnCursor {
+
+    public:
+
+        /** \param k The number of nearest neighbours to find.
+            \param candidates The number of candidates kept by each search
+                              of the tree, or 0 for 2k + 8.  More last
+                              longer as the query moves, but take longer
+                              to re-score.
+        */
+        KnnCursor(size_t k, size_t candidates = 0)
+            : pq(candidates ? std::max(candidates, k) : 2 * k + 8)
+            , nearest(k)
+            , reach(0)
+            , survival(1)
+            , gap(0)
+            , hits(0)
+            , tree(0)
+        {
+        }
+
+        /** Forgets the previous queries, so that the next search is cold. */
+        void reset()
+        {
+            results.clear();
+            candidates.clear();
+            seeds.clear();
+            anchor.clear();
+            survival = 1;
+            tree = 0;
+        }
+
+        /** The neighbours of the last query and their squared distances,
+            nearest first.
+        */
+        std::vector<std::pair<Point *, Number> > results;
+
+        /** Scratch state for the searches, whose stats and traversal may
+            be set as for any other search.
+        */
+        SearchContext ctx;
+
+    private:
+
+        friend class KdTree;
+
+        //collect the candidates during a search of the tree, all of them
+        //or only the k nearest if the query is moving too fast for more
+        //to be worthwhile
+        TopK<Point *> pq;
+        TopK<Point *> nearest;
+
+        //the candidates, in order of their distance from the last query,
+        //and the query they were found for. no other point is nearer the
+        //anchor than reach.
+        std::vector<std::pair<Number, Point *> > candidates;
+        std::vector<Number> anchor;
+        Number reach;
+
+        //the candidates sorted by address, kept from being found again
+        std::vector<Point *> seeds;
+
+        //the share of the neighbours found by recent searches of the tree
+        //that were already candidates
+        double survival;
+
+        //half the distance from the kth neighbour to reach after the last
+        //search for all the candidates, which the query may move straight
+        //by and leave them valid, and the queries answered from the
+        //candidates since the last search
+        Number gap;
+        size_t hits;
+
+        const KdTree *tree;
+
+        KnnCursor(const KnnCursor &);
+        void operator=(const KnnCursor &);
+    };
+
+    /** Rules for choosing the axis and value at which to split a branch. */
+    enum SplitRule {
+        /** Cycle through the axes with depth, split at the median. */
+        SPLIT_CYCLE,
+
+        /** Split the axis along which the points are most spread out at
+            the median.
+        */
+        SPLIT_MAX_SPREAD,
+
+        /** Split the axis with the greatest variance over a sample of the
+            points at the median.
+        */
+        SPLIT_MAX_VARIANCE,
+
+        /** Split the longest side of the cell at its midpoint, sliding the
+            split to the nearest point if all points lie to one side, as in
+            ANN.  Cells stay fat on clustered data but the tree is no longer
+            balanced.
+        */
+        SPLIT_SLIDING_MIDPOINT
+    };
+
+    /** Orders in which the nodes of a tree are laid out in memory. */
+    enum NodeLayout {
+        /** Depth first, left subtree before right.  A node's left child is
+            the next node, but its right child may be arbitrarily far away.
+        */
+        LAYOUT_PREORDER,
+
+        /** The top half of the levels of the tree first, then each subtree
+            hanging below them, with every part laid out the same way
+            recursively (van Emde Boas order).  A descent touches a new
+            cache line or page only every few levels whatever their size,
+            so deep searches of large trees take far fewer cache and TLB
+            misses.  Costs a pass over the nodes after the build.
+        */
+        LAYOUT_VAN_EMDE_BOAS
+    };
+
+    /** Settings controlling how a tree is built. */
+    struct Options {
+
+        Options()
+            : bucket_size(1)
+            , copy_coords(false)
+            , split(SPLIT_CYCLE)
+            , variance_sample(64)
+            , seed(1)
+            , pool(0)
+            , huge_pages(false)
+            , first_touch(false)
+            , layout(LAYOUT_PREORDER)
+        {
         }
+
+        /** The maximum number of points stored in a leaf.  Larger buckets
+            give a much smaller tree whose leaves are scanned linearly.
+        */
+        size_t bucket_size;
+
+        /** If set, the tree copies the coordinates of every point into a
+            block it owns, one point after another in tree order, so that
+            queries read coordinates sequentially and never dereference the
+            input points.  Results still refer to the input points.
+            Distances and range tests on the copied coordinates use
+            vectorized kernels where the processor supports them.
+        */
+        bool copy_coords;
+
+        /** How to choose the axis and value at which each branch splits. */
+        SplitRule split;
+
+        /** The number of points sampled per branch by SPLIT_MAX_VARIANCE. */
+        size_t variance_sample;
+
+        /** Seeds the choice of pivots when finding medians.  Building from
+            the same points in the same order with the same seed always
+            gives the same tree, serially or in parallel.
+        */
+        unsigned long long seed;
+
+        /** If set, subtrees are built in parallel on this pool.  The
+            resulting tree is laid out exactly as a serial build would be.
+        */
+        ThreadPool *pool;
+
+        /** If set, the nodes and copied coordinates are allocated on huge
+            pages, so that random traversals of a large tree take far fewer
+            TLB misses.  Explicit huge pages (MAP_HUGETLB) are used if enough
+            are reserved, and transparent huge pages (MADV_HUGEPAGE) if not.
+        */
+        bool huge_pages;
+
+        /** If set along with pool, the pages of the nodes are first written
+            by the threads of the pool in contiguous chunks before the build,
+            so they are spread over the NUMA nodes the threads run on rather
+            than placed by whichever thread builds each subtree.  Copied
+            coordinates are always first written by the pool.
+        */
+        bool first_touch;
+
+        /** The order of the nodes in memory. */
+        NodeLayout layout;
     };
 
-    KdTree(size_t dim, Point *pts, size_t n)
-        : dim(dim)
+    KdTree(size_t dim, Point *pts, size_t n, const Options &options = Options())
+        : n(n)
+        , runtime_dim(dim)
         , arena(0)
-        , searchpq(std::max(32, (int)log(n)))
+        , pts(pts)
+        , coords(0)
+        , bounds(0)
+        , kernels(0)
+        , mapping(0)
+        , mapping_size(0)
+        , huge_pages(options.huge_pages)
     {
-        arena = (Node *)mmap(0, n*sizeof(Node), PROT_READ|PROT_WRITE,
-            MAP_PRIVATE|MAP_ANON, -1, 0);
-        arena_offset = 0;
-        root = build_kdtree(pts, n, 0);
-        this->n = n;
+        build(pts, 0, 0, options);
     }
 
+    /** Called on each node as it is built, with the bounds of its cell,
+        to decide whether the node should be terminal.  The root cell is the
+        range passed to the constructor, widened if necessary to contain
+        every point.  When building on a thread pool this may be called
+        concurrently from several threads.
+    */
     struct EndBuildFn {
         virtual bool operator()(Node *, Number *)
         {
@@ -77,552 +619,3048 @@ public:
         }
     };
 
-    KdTree(size_t dim, Point *pts, size_t n, Number *range, EndBuildFn &fn) : dim(dim), arena(0)
+    KdTree(size_t dim, Point *pts, size_t n, Number *range, EndBuildFn &fn,
+        const Options &options = Options())
+        : n(n)
+        , runtime_dim(dim)
+        , arena(0)
+        , pts(pts)
+        , coords(0)
+        , bounds(0)
+        , kernels(0)
+        , mapping(0)
+        , mapping_size(0)
+        , huge_pages(options.huge_pages)
+    {
+        build(pts, range, &fn, options);
+    }
+
+
+    virtual ~KdTree()
     {
-        arena = (Node *)mmap(0, n*sizeof(Node), PROT_READ|PROT_WRITE,
-            MAP_PRIVATE|MAP_ANON, -1, 0);
-        arena_offset = 0;
+        for (size_t i = 0; i < replicas.size(); ++i) delete replicas[i];
 
-        root = build_kdtree(pts, n, 0, range, fn);
+        if (mapping) {
+            munmap(mapping, mapping_size);
+            return;
+        }
 
-        this->n = n;
+        if (arena) release(arena, arena_size*sizeof(Node), huge_pages);
+        if (coords) release(coords, n*dim()*sizeof(Number), huge_pages);
+        delete[] bounds;
     }
 
+    /** Copies the nodes and any tree-owned coordinates to memory on each
+        NUMA node of the machine, and routes every later query to the copy
+        on the node of the calling thread, so no thread reads the tree from
+        another socket.  The input points are not copied, so a tree which
+        does not copy coordinates still reads them wherever they are.  Does
+        nothing on a machine with a single node, or if the tree has already
+        been copied.  Must not be called concurrently with queries.
 
-    virtual ~KdTree()
+        \return The number of copies made.
+    */
+    size_t replicate_numa()
+    {
+        if (!replicas.empty()) return 0;
+
+        std::vector<int> nodes;
+        if (!read_cpu_list("/sys/devices/system/node/online", nodes) || nodes.size() < 2) return 0;
+
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            char path[64];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nodes[i]);
+
+            std::vector<int> cpus;
+            if (!read_cpu_list(path, cpus)) continue;
+
+            for (size_t j = 0; j < cpus.size(); ++j) {
+                if ((size_t)cpus[j] >= cpu_nodes.size()) cpu_nodes.resize(cpus[j] + 1, -1);
+                cpu_nodes[cpus[j]] = nodes[i];
+            }
+        }
+
+        replicas.resize(*std::max_element(nodes.begin(), nodes.end()) + 1, 0);
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            replicas[nodes[i]] = new KdTree(*this, nodes[i]);
+        }
+
+        return nodes.size();
+    }
+
+    /** Returns the points within an axis aligned box.
+
+        \param range The box, as a lower and upper bound for each dimension.
+    */
+    std::vector<Point *> range_search(Number *range) const
+    {
+        std::vector<Point *> qr;
+        range_search(range, qr);
+
+        return qr;
+    }
+
+    /** Appends the points within an axis aligned box to qr, which is not
+        cleared first.  Reusing qr across queries avoids allocating once it
+        has grown large enough.
+
+        \param range The box, as a lower and upper bound for each dimension.
+        \param qr The vector to append results to.
+        \param stats If set, the work done by the query is added here.
+    */
+    void range_search(Number *range, std::vector<Point *> &qr,
+        SearchStats *stats = 0) const
     {
-        if (arena) munmap(arena, n*sizeof(Node));
+        Appender appender(qr);
+        range_visit(range, appender, stats);
     }
 
-    std::vector<Point *> range_search(Number *range)
+    /** Calls visitor(Point *) once for each point within an axis aligned box,
+        in no particular order, without allocating.
+
+        \param range The box, as a lower and upper bound for each dimension.
+        \param visitor The function object to call for each point.
+        \param stats If set, the work done by the query is added here.
+    */
+    template<class Visitor> void range_visit(Number *range, Visitor &visitor,
+        SearchStats *stats = 0) const
+    {
+        const KdTree &tree = local();
+        if (&tree != this) return tree.range_visit(range, visitor, stats);
+
+        if (!root) return;
+
+        //set up region
+        Region region(dim());
+
+        //run query
+        if (stats) {
+            range_visit(root, range, region.data, visitor, *stats);
+        } else {
+            NoStats none;
+            range_visit(root, range, region.data, visitor, none);
+        }
+    }
+
+    /** Returns the number of points within an axis aligned box.  Subtrees
+        entirely inside the box are counted without visiting them, so the
+        cost depends on how many cells the boundary of the box crosses rather
+        than on the number of points found.
+
+        \param range The box, as a lower and upper bound for each dimension.
+        \param stats If set, the work done by the query is added here.
+    */
+    size_t range_count(Number *range, SearchStats *stats = 0) const
     {
+        const KdTree &tree = local();
+        if (&tree != this) return tree.range_count(range, stats);
+
+        if (!root) return 0;
+
         //set up region
-        Number *region = new Number[2 * dim];
-        for (int i = 0; i < dim; ++i) {
-            region[i] = -std::numeric_limits<Number>::max();
-            region[i + 1] = std::numeric_limits<Number>::max();
+        Region region(dim());
+
+        //run query
+        if (stats) return range_count(root, range, region.data, *stats);
+
+        NoStats none;
+        return range_count(root, range, region.data, none);
+    }
+
+    /** Returns the points within distance r of a point.
+
+        \param pt The centre of the ball.
+        \param r The radius of the ball.  Points at exactly r are included.
+    */
+    std::vector<Point *> radius_search(const Point &pt, Number r) const
+    {
+        std::vector<Point *> qr;
+        radius_search(pt, r, qr);
+
+        return qr;
+    }
+
+    /** Appends the points within distance r of a point to qr, which is not
+        cleared first.
+
+        \param pt The centre of the ball.
+        \param r The radius of the ball.  Points at exactly r are included.
+        \param qr The vector to append results to.
+        \param stats If set, the work done by the query is added here.
+    */
+    void radius_search(const Point &pt, Number r, std::vector<Point *> &qr,
+        SearchStats *stats = 0) const
+    {
+        Appender appender(qr);
+        radius_visit(pt, r, appender, stats);
+    }
+
+    /** Calls visitor(Point *) once for each point within distance r of a
+        point, in no particular order.  Cells are pruned by their true
+        distance from the centre, and cells lying entirely inside the ball
+        are reported without testing their points.
+
+        \param pt The centre of the ball.
+        \param r The radius of the ball.  Points at exactly r are included.
+        \param visitor The function object to call for each point.
+        \param stats If set, the work done by the query is added here.
+    */
+    template<class Visitor> void radius_visit(const Point &pt, Number r,
+        Visitor &visitor, SearchStats *stats = 0) const
+    {
+        const KdTree &tree = local();
+        if (&tree != this) return tree.radius_visit(pt, r, visitor, stats);
+
+        if (!root) return;
+
+        Region region(dim()), query(dim());
+        start_radius_query(pt, region.data, query.data);
+
+        if (box_distance(query.data, region.data) > r * r) {
+            if (stats) ++stats->pruned;
+        } else if (stats) {
+            radius_visit(root, query.data, r * r, region.data, visitor, *stats);
+        } else {
+            NoStats none;
+            radius_visit(root, query.data, r * r, region.data, visitor, none);
+        }
+    }
+
+    /** Returns the number of points within distance r of a point.  Cells
+        lying entirely inside the ball are counted from their subtree sizes.
+
+        \param pt The centre of the ball.
+        \param r The radius of the ball.  Points at exactly r are included.
+        \param stats If set, the work done by the query is added here.
+    */
+    size_t radius_count(const Point &pt, Number r, SearchStats *stats = 0) const
+    {
+        const KdTree &tree = local();
+        if (&tree != this) return tree.radius_count(pt, r, stats);
+
+        if (!root) return 0;
+
+        Region region(dim()), query(dim());
+        start_radius_query(pt, region.data, query.data);
+
+        if (box_distance(query.data, region.data) > r * r) {
+            if (stats) ++stats->pruned;
+            return 0;
+        }
+
+        if (far_distance(query.data, region.data) <= r * r) {
+            if (stats) ++stats->contained;
+            return root->count;
+        }
+
+        if (stats) return radius_count(root, query.data, r * r, region.data, *stats);
+
+        NoStats none;
+        return radius_count(root, query.data, r * r, region.data, none);
+    }
+
+    /** This function searches for the k nearest neighbours to a query point.
+
+        \param k The number of nearest neighbours to find.
+        \param pt The point for which to find the nearest neighbour.
+        \param eps The epsilon for approximate nearest neighbour searches.
+        \return A list containing points and distances of the k nearest neighbours
+                to the query point.
+    */
+    std::list<std::pair<Point *, Number> > knn(size_t k, const Point &pt, Number eps) const
+    {
+        SearchContext ctx(n);
+        return knn(ctx, k, pt, eps);
+    }
+
+    /** As above, but uses caller-owned scratch state rather than allocating
+        it for each query.
+
+        \param ctx The search context to use, which must not be shared with
+                   any other concurrently running query.
+        \param k The number of nearest neighbours to find.
+        \param pt The point for which to find the nearest neighbour.
+        \param eps The epsilon for approximate nearest neighbour searches.
+        \return A list containing points and distances of the k nearest neighbours
+                to the query point.
+    */
+    std::list<std::pair<Point *, Number> > knn(SearchContext &ctx, size_t k,
+        const Point &pt, Number eps) const
+    {
+        TopK<Point *> pq(k);
+
+        knn_search(ctx, pq, pt, eps);
+
+        std::list<std::pair<Point *, Number> > qr;
+        while(pq.length) {
+            typename TopK<Point *>::Entry e = pq.pop();
+            qr.push_front(std::make_pair(e.data, e.priority));
+        }
+
+        return qr;
+    }
+
+    /** This function searches for the k nearest neighbours to a query point.
+        It takes an initial set of points which may be nearest neighbours
+        of the query point, which potentially reduces how much of the tree
+        must be searched.  Points already in the queue are not added again.
+
+        \param pq A priority queue containing potential nearest neighbours to the
+                  query point.
+        \param pt The point for which to find the nearest neighbour.
+        \param eps The epsilon for approximate nearest neighbour searches.
+        \return A list containing points and distances of the k nearest neighbours
+                to the query point.
+    */
+    std::list<std::pair<Point *, Number> > knn(FixedSizePriorityQueue<Point *> &pq, const Point &pt, Number eps) const
+    {
+        SearchContext ctx(n);
+        return knn(ctx, pq, pt, eps);
+    }
+
+    /** As above, but uses caller-owned scratch state.
+
+        \param ctx The search context to use.
+        \param pq A priority queue containing potential nearest neighbours to the
+                  query point.
+        \param pt The point for which to find the nearest neighbour.
+        \param eps The epsilon for approximate nearest neighbour searches.
+        \return A list containing points and distances of the k nearest neighbours
+                to the query point.
+    */
+    std::list<std::pair<Point *, Number> > knn(SearchContext &ctx,
+        FixedSizePriorityQueue<Point *> &pq, const Point &pt, Number eps) const
+    {
+        knn_search(ctx, pq, pt, eps);
+
+        std::list<std::pair<Point *, Number> > qr;
+        while(pq.length) {
+            typename FixedSizePriorityQueue<Point *>::Entry e = pq.pop();
+            qr.push_front(std::make_pair(e.data, e.priority));
+        }
+
+        return qr;
+    }
+
+    /** Adds the nearest neighbours of a query point among the points
+        accepted by a filter to a priority queue, which keeps the nearest of
+        everything pushed to it up to its capacity.  The queue is neither
+        cleared nor drained, so several trees can be searched in turn, with
+        the neighbours already found bounding each search.
+
+        \param ctx The search context to use.
+        \param pq The priority queue to add neighbours to.
+        \param pt The point for which to find the nearest neighbours.
+        \param eps The epsilon for approximate nearest neighbour searches.
+        \param filter A function object called as filter(Point *), returning
+                      whether the point may be reported.
+    */
+    template<class Filter> void knn_accumulate(SearchContext &ctx,
+        FixedSizePriorityQueue<Point *> &pq, const Point &pt, Number eps,
+        Filter &filter) const
+    {
+        knn_search(ctx, pq, pt, eps, filter);
+    }
+
+    /** As above, but adds neighbours to a TopK, which unlike a
+        FixedSizePriorityQueue does not check them for duplicates, so it
+        must not already hold any point of this tree.  With a capacity fixed
+        at compile time the collector is chosen and sized at compile time.
+    */
+    template<class Filter, size_t K> void knn_accumulate(SearchContext &ctx,
+        TopK<Point *, K> &pq, const Point &pt, Number eps, Filter &filter) const
+    {
+        knn_search(ctx, pq, pt, eps, filter);
+    }
+
+    /** This function searches for the k nearest neighbours to a query point
+        starting from the candidates of the cursor's previous search, which
+        for a query close to the last is far quicker than a search from
+        scratch.
+
+        \param cursor The cursor, which is given the neighbours found.
+        \param pt The point for which to find the nearest neighbours.
+        \param eps The epsilon for approximate nearest neighbour searches.
+    */
+    void knn(KnnCursor &cursor, const Point &pt, Number eps) const
+    {
+        const KdTree &tree = local();
+        if (&tree != this) return tree.knn(cursor, pt, eps);
+
+        if (cursor.tree != this) {
+            cursor.reset();
+            cursor.tree = this;
+        }
+
+        size_t k = cursor.nearest.capacity();
+        if (!root || !k) {
+            cursor.results.clear();
+            return;
+        }
+
+        const Number *q = cursor.ctx.load_query(pt, dim());
+
+        //every other point is at least reach - moved from the query, so
+        //if the k nearest candidates are nearer than that they are the
+        //neighbours. once too few neighbours carry over from one search to
+        //the next for that to happen, the candidates are not re-scored.
+        std::vector<std::pair<Number, Point *> > &candidates = cursor.candidates;
+        bool reuse = cursor.survival * 100 >= cursor_min_survival;
+
+        Number moved = 0;
+        for (size_t i = 0; i < cursor.anchor.size(); ++i) {
+            moved += (q[i] - cursor.anchor[i]) * (q[i] - cursor.anchor[i]);
+        }
+        moved = sqrt(moved);
+
+        Number slack = candidates.empty() || !reuse ? 0 : cursor.reach - moved;
+        if (slack > 0) {
+
+            //the candidates were in order for the last query, so are
+            //nearly in order for this one
+            for (size_t i = 0; i < candidates.size(); ++i) {
+                std::pair<Number, Point *> c(distance(q, candidates[i].second),
+                    candidates[i].second);
+
+                size_t j = i;
+                for (; j > 0 && c < candidates[j - 1]; --j) {
+                    candidates[j] = candidates[j - 1];
+                }
+                candidates[j] = c;
+            }
+
+            //without k candidates there are no other points
+            size_t found = std::min(k, candidates.size());
+            if (candidates[found - 1].first < slack * slack) {
+                cursor.results.resize(found);
+                for (size_t i = 0; i < found; ++i) {
+                    cursor.results[i] = std::make_pair(candidates[i].second,
+                        candidates[i].first);
+                }
+
+                ++cursor.hits;
+                return;
+            }
+        }
+
+        //otherwise search the tree for new candidates. while the query is
+        //still within reach of the old ones they bound the search from the
+        //start, and are kept from being found again. unless the query has
+        //been moving slowly enough for more to last, only k are kept.
+        bool wide = reuse
+            && (candidates.empty() || moved / (cursor.hits + 1) < cursor.gap);
+        TopK<Point *> &pq = wide ? cursor.pq : cursor.nearest;
+        pq.clear();
+        cursor.hits = 0;
+
+        if (slack > 0 && wide) {
+            for (size_t i = 0; i < candidates.size(); ++i) {
+                pq.push(candidates[i].first, candidates[i].second);
+            }
+
+            SeedFilter filter(cursor.seeds);
+            knn_search(cursor.ctx, pq, pt, eps, filter);
+        } else {
+            AcceptAll all;
+            knn_search(cursor.ctx, pq, pt, eps, all);
+        }
+
+        //every point within the old reach of the anchor was a candidate.
+        //hits re-score the candidates against later queries, so their own
+        //distances are no longer from the anchor.
+        Number last = candidates.empty() ? 0 : cursor.reach * cursor.reach;
+
+        //an approximate search may have missed points nearer than the
+        //furthest candidate by up to a factor of 1 + eps
+        cursor.reach = pq.full() ? sqrt(pq.peek().priority) / (1 + eps)
+            : std::numeric_limits<Number>::max();
+
+        size_t found = pq.length;
+        candidates.resize(found);
+        cursor.results.resize(std::min(found, k));
+        for (size_t i = found; i-- > 0; ) {
+            typename TopK<Point *>::Entry e = pq.pop();
+            candidates[i] = std::make_pair((Number)e.priority, e.data);
+            if (i < cursor.results.size()) {
+                cursor.results[i] = std::make_pair(e.data, (Number)e.priority);
+            }
+        }
+
+        if (wide) {
+            cursor.gap = (cursor.reach - sqrt(cursor.results.back().second)) / 2;
+        }
+
+        //the share of the neighbours that were already candidates, averaged
+        //over the last few searches
+        if (last > 0) {
+            size_t kept = 0;
+            for (size_t i = 0; i < cursor.results.size(); ++i) {
+                kept += distance(&cursor.anchor[0], cursor.results[i].first) <= last;
+            }
+            cursor.survival = (3 * cursor.survival
+                + (double)kept / cursor.results.size()) / 4;
+        }
+        cursor.anchor.assign(q, q + dim());
+
+        //the seeds are only needed if the next search may re-score them
+        cursor.seeds.clear();
+        if (cursor.survival * 100 >= cursor_min_survival) {
+            for (size_t i = 0; i < found; ++i) {
+                cursor.seeds.push_back(candidates[i].second);
+            }
+            std::sort(cursor.seeds.begin(), cursor.seeds.end());
+        }
+    }
+
+    /** Returns the traversal a context set to KNN_AUTO uses to search for
+        k nearest neighbours.  Depth first is chosen for few neighbours, or
+        in higher dimensions, where a best first queue grows long; epsilon
+        made little difference to which was faster on the benchmarks.
+
+        \param k The number of nearest neighbours to find.
+        \param eps The epsilon for approximate nearest neighbour searches.
+    */
+    KnnTraversal knn_traversal(size_t k, Number) const
+    {
+        return k <= depth_first_max_k || dim() >= depth_first_min_dim
+            ? KNN_DEPTH_FIRST : KNN_BEST_FIRST;
+    }
+
+    /** This function searches for the k nearest neighbours of each of a batch
+        of query points, spreading the queries across a thread pool.  Results
+        are written to caller-provided arrays of nq * k entries, with the
+        neighbours of query i at [i * k, (i + 1) * k) in order of increasing
+        distance.  If fewer than k neighbours exist, the remaining entries
+        are set to 0 and the maximum Number.
+
+        \param queries The query points.
+        \param nq The number of query points.
+        \param k The number of nearest neighbours to find for each query.
+        \param eps The epsilon for approximate nearest neighbour searches.
+        \param out_ptrs Receives the nearest neighbour points.
+        \param out_dists Receives the squared distances to the nearest neighbours.
+        \param pool The thread pool to use, or 0 to create one with a thread
+                    per online processor for the duration of the call.
+    */
+    void knn_batch(const Point *queries, size_t nq, size_t k, Number eps,
+        Point **out_ptrs, Number *out_dists, ThreadPool *pool = 0) const
+    {
+        if (nq == 0 || k == 0) return;
+
+        ThreadPool *owned = pool ? 0 : new ThreadPool;
+        if (!pool) pool = owned;
+
+        SearchContext *contexts = new SearchContext[pool->size()];
+
+        KnnBatchBody body(*this, contexts, queries, k, eps, out_ptrs, out_dists);
+        pool->parallel_for(0, nq, knn_batch_grain, body);
+
+        delete[] contexts;
+        delete owned;
+    }
+
+    /** This function finds the k nearest neighbours of every one of a set
+        of query points at once.  A tree is built over the queries and the
+        two trees are traversed together, so a pair of query and reference
+        cells too far apart to hold any neighbour of the queries is pruned in
+        one step, and nearby queries share the descent to their neighbours
+        rather than each starting from the root.  Query subtrees are searched
+        in parallel.  Results are written as by knn_batch(), with the
+        neighbours of queries[i] at [i * k, (i + 1) * k).
+
+        \param queries The query points, which are not modified.
+        \param nq The number of query points.
+        \param k The number of nearest neighbours to find for each query.
+        \param eps The epsilon for approximate nearest neighbour searches.
+        \param out_ptrs Receives the nearest neighbour points.
+        \param out_dists Receives the squared distances to the nearest neighbours.
+        \param pool The thread pool to use, or 0 to create one with a thread
+                    per online processor for the duration of the call.
+    */
+    void knn_join(const Point *queries, size_t nq, size_t k, Number eps,
+        Point **out_ptrs, Number *out_dists, ThreadPool *pool = 0) const
+    {
+        if (nq == 0 || k == 0) return;
+
+        for (size_t i = 0; i < nq * k; ++i) {
+            out_ptrs[i] = 0;
+            out_dists[i] = std::numeric_limits<Number>::max();
+        }
+
+        if (!root) return;
+
+        ThreadPool *owned = pool ? 0 : new ThreadPool;
+        if (!pool) pool = owned;
+
+        //the query tree refers back to the queries, so they stay in place
+        std::vector<JoinQuery> refs(nq);
+        for (size_t i = 0; i < nq; ++i) refs[i].p = &queries[i];
+
+        typename JoinTree::Options options;
+        options.bucket_size = join_bucket_size;
+        options.copy_coords = true;
+        options.split = (typename JoinTree::SplitRule)split;
+        options.pool = pool;
+        JoinTree query_tree(dim(), &refs[0], nq, options);
+
+        SearchContext *contexts = new SearchContext[pool->size()];
+        std::vector<JoinBound> bounds(query_tree.arena_offset);
+
+        KnnJoin join(*this, query_tree, queries, k, eps, out_ptrs, out_dists,
+            contexts, &bounds[0]);
+        JoinTask task(join, query_tree.root, query_tree.bounds);
+        pool->run(task);
+
+        //each query's neighbours are a heap, furthest first, so sort them
+        JoinSortBody body(k, out_ptrs, out_dists);
+        pool->parallel_for(0, nq, knn_batch_grain, body);
+
+        delete[] contexts;
+        delete owned;
+    }
+
+    /** This function searches for a single exact nearest neighbour and returns
+        the Node containing it.  This is useful for building caches on top of
+        the kd-tree.
+
+        \param pt The point for which to find the nearest neighbour.
+        \return The Node containing the nearest neighbour.
+    */
+    Node *nn(const Point &pt) const
+    {
+        SearchContext ctx(n);
+        return nn(ctx, pt);
+    }
+
+    /** As above, but uses caller-owned scratch state.
+
+        \param ctx The search context to use.
+        \param pt The point for which to find the nearest neighbour.
+        \return The Node containing the nearest neighbour.
+    */
+    Node *nn(SearchContext &ctx, const Point &pt) const
+    {
+        TopK<Point *, 1> pq;
+        knn_search(ctx, pq, pt, 0.0);
+        if (!pq.length) return 0;
+
+        typename TopK<Point *, 1>::Entry e = pq.pop();
+        return node_of(e.data);
+    }
+
+    /** This function finds the node holding a point of the tree.  Each
+        subtree holds a contiguous slice of the (reordered) input points,
+        so this is a descent by address rather than by coordinate.
+
+        \param p A point in the array the tree was built from.
+        \return The Node holding the point, or 0 if the point is not
+                reachable from the root.
+    */
+    Node *node_of(const Point *p) const
+    {
+        const KdTree &tree = local();
+        if (&tree != this) return tree.node_of(p);
+
+        Node *node = root;
+
+        while (node) {
+            if (p >= node->pt() && p < node->pt() + node->stored()) {
+                return node;
+            } else if (p < node->pt()) {
+                node = node->left();
+            } else {
+                node = node->right();
+            }
+        }
+
+        return 0;
+    }
+
+    /** This function searches for the node containing a query point.
+        Since we don't track the bounds of the original point set, this will
+        return incorrect results if the query point is outside of the bounds
+        of the kd-tree.  If the query point falls in an empty branch, the
+        branch node above it is returned.
+
+        \param pt The point for which to locate the node.
+        \return The Node containing the query point.
+    */
+    Node *locate(const Point &pt) const
+    {
+        const KdTree &tree = local();
+        if (&tree != this) return tree.locate(pt);
+
+        Node *node = root;
+
+        while (node && !node->leaf()) {
+
+            Node *next;
+            if (pt[node->axis] < node->median) {
+                next = node->left();
+            } else {
+                next = node->right();
+            }
+
+            if (!next) break;
+            node = next;
+        }
+
+        return node;
+    }
+
+    /** Writes the tree and the coordinates of its points, in tree order, to
+        a file which open_mapped() maps straight back into memory.  The file
+        uses the native byte order and structure layout, so it can only be
+        opened by the same KdTree type built by a compatible compiler.
+
+        \param path The file to write.
+        \return Whether the whole file was written.
+    */
+    bool save(const char *path) const
+    {
+        FILE *f = fopen(path, "wb");
+        if (!f) return false;
+
+        FileHeader header = file_header();
+        bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+        //bounding box of the root cell
+        ok = ok && pad_file(f, header.bounds_offset);
+        if (bounds) ok = ok && fwrite(bounds, sizeof(Number), 2 * dim(), f) == 2 * dim();
+
+        //nodes, with point offsets relative to where they land in the file
+        ok = ok && pad_file(f, header.nodes_offset);
+        Node buffer[file_chunk];
+        for (size_t i = 0; ok && i < arena_offset; i += file_chunk) {
+            size_t count = std::min(file_chunk, arena_offset - i);
+            for (size_t j = 0; j < count; ++j) {
+                buffer[j] = root[i + j];
+                size_t node_pos = header.nodes_offset + (i + j) * sizeof(Node);
+                size_t pt_pos = header.coords_offset
+                    + (root[i + j].pt() - pts) * dim() * sizeof(Number);
+                buffer[j].pt_offset = (long)pt_pos - (long)node_pos;
+            }
+            ok = fwrite(buffer, sizeof(Node), count, f) == count;
+        }
+
+        //coordinates in tree order
+        ok = ok && pad_file(f, header.coords_offset);
+        if (coords) {
+            ok = ok && fwrite(coords, sizeof(Number), n * dim(), f) == n * dim();
+        } else {
+            Number row[file_chunk];
+            for (size_t i = 0; ok && i < n; ++i) {
+                for (size_t d = 0; ok && d < dim(); d += file_chunk) {
+                    size_t count = std::min(file_chunk, dim() - d);
+                    for (size_t j = 0; j < count; ++j) row[j] = pts[i][d + j];
+                    ok = fwrite(row, sizeof(Number), count, f) == count;
+                }
+            }
+        }
+
+        return fclose(f) == 0 && ok;
+    }
+
+    /** Maps a tree written by save() read-only into memory.  Nothing is
+        read or copied up front, and the pages are shared through the page
+        cache with every other process mapping the same file.
+
+        The coordinates in the file become the points of the tree, so Point
+        must be laid out as dim Numbers, as Number[dim] or a struct holding
+        only that is, and results point into the read-only mapping.
+
+        \param path The file to map.
+        \return The tree, to be deleted by the caller, or 0 if the file could
+                not be mapped or was not written by a compatible tree.
+    */
+    static KdTree *open_mapped(const char *path)
+    {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return 0;
+
+        struct stat st;
+        if (fstat(fd, &st) || (size_t)st.st_size < sizeof(FileHeader)) {
+            close(fd);
+            return 0;
+        }
+
+        void *mapping = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) return 0;
+
+        const FileHeader &header = *(const FileHeader *)mapping;
+        if (!compatible(header, st.st_size)) {
+            munmap(mapping, st.st_size);
+            return 0;
+        }
+
+        return new KdTree(header, (char *)mapping, st.st_size);
+    }
+
+    Node *root;
+
+private:
+
+    //queries handed to a thread at a time by knn_batch
+    static const size_t knn_batch_grain = 256;
+
+    struct KnnBatchBody {
+
+        KnnBatchBody(const KdTree &tree, SearchContext *contexts,
+            const Point *queries, size_t k, Number eps,
+            Point **out_ptrs, Number *out_dists)
+            : tree(tree)
+            , contexts(contexts)
+            , queries(queries)
+            , k(k)
+            , eps(eps)
+            , out_ptrs(out_ptrs)
+            , out_dists(out_dists)
+        {
+        }
+
+        void operator()(size_t begin, size_t end, size_t thread)
+        {
+            SearchContext &ctx = contexts[thread];
+            TopK<Point *> pq(k);
+
+            for (size_t i = begin; i < end; ++i) {
+
+                tree.knn_search(ctx, pq, queries[i], eps);
+
+                Point **ptrs = out_ptrs + i * k;
+                Number *dists = out_dists + i * k;
+
+                //queue pops furthest first, so fill from the back
+                size_t j = k;
+                while (j > pq.length) {
+                    --j;
+                    ptrs[j] = 0;
+                    dists[j] = std::numeric_limits<Number>::max();
+                }
+
+                while (pq.length) {
+                    typename TopK<Point *>::Entry e = pq.pop();
+                    --j;
+                    ptrs[j] = e.data;
+                    dists[j] = e.priority;
+                }
+            }
+        }
+
+        const KdTree &tree;
+        SearchContext *contexts;
+        const Point *queries;
+        size_t k;
+        Number eps;
+        Point **out_ptrs;
+        Number *out_dists;
+    };
+
+    //a query point in the tree built by knn_join
+    struct JoinQuery {
+        inline Number operator[](size_t i) const
+        {
+            return (*p)[i];
+        }
+
+        const Point *p;
+    };
+
+    typedef KdTree<JoinQuery, Number, Dim> JoinTree;
+
+    template<class, class, size_t> friend class KdTree;
+
+    //points per leaf of the query tree built by knn_join
+    static const size_t join_bucket_size = 16;
+
+    //query subtrees smaller than this are joined without spawning tasks
+    static const size_t join_grain = 1 << 11;
+
+    /** Bounds on the distances to the kth neighbours of the queries in the
+        subtree at a query node, as found so far.
+    */
+    struct JoinBound {
+
+        JoinBound()
+            : furthest(std::numeric_limits<Number>::max())
+            , nearest(std::numeric_limits<Number>::max())
+            , reach(std::numeric_limits<Number>::max())
+        {
+        }
+
+        //the furthest and nearest kth neighbour found for any query
+        Number furthest, nearest;
+
+        //no query has its kth true neighbour further than this
+        Number reach;
+    };
+
+    /** The state of a knn_join.  The neighbours found so far for each query
+        are kept as a max-heap in its slice of the output arrays, and each
+        query node has bounds on the kth neighbour distances beneath it.  A
+        pair of query and reference cells is pruned once the gap between them
+        is beyond those bounds.
+
+        Every node of either tree holds points of its own as well as having
+        children, so the pair (Q, R) covers the points at Q against those at
+        R, each child of Q against each child of R, the points at Q against
+        the subtrees of R's children and the points at R against those of
+        Q's children.  The last two are single point searches down one tree.
+        Once Q is a leaf its queries descend R together instead.
+    */
+    struct KnnJoin {
+
+        typedef typename JoinTree::Node JoinNode;
+
+        KnnJoin(const KdTree &tree, const JoinTree &queries, const Point *first,
+            size_t k, Number eps, Point **out_ptrs, Number *out_dists,
+            SearchContext *contexts, JoinBound *bounds)
+            : tree(tree)
+            , queries(queries)
+            , first(first)
+            , k(k)
+            , max_error((1.0 + eps) * (1.0 + eps))
+            , out_ptrs(out_ptrs)
+            , out_dists(out_dists)
+            , contexts(contexts)
+            , bounds(bounds)
+        {
+        }
+
+        //the same join, reading another copy of the reference tree
+        KnnJoin(const KnnJoin &join, const KdTree &tree)
+            : tree(tree)
+            , queries(join.queries)
+            , first(join.first)
+            , k(join.k)
+            , max_error(join.max_error)
+            , out_ptrs(join.out_ptrs)
+            , out_dists(join.out_dists)
+            , contexts(join.contexts)
+            , bounds(join.bounds)
+        {
+        }
+
+        const Number *coords(const JoinQuery *q) const
+        {
+            return queries.coords + (q - queries.pts) * queries.dim();
+        }
+
+        size_t slot(const JoinQuery *q) const
+        {
+            return (q->p - first) * k;
+        }
+
+        JoinBound &bound(JoinNode *q)
+        {
+            return bounds[q - queries.root];
+        }
+
+        //whether no point beyond a gap can be a neighbour of a query at q
+        bool prune(JoinNode *q, Number gap)
+        {
+            const JoinBound &b = bound(q);
+            return gap * max_error >= b.furthest || gap > b.reach;
+        }
+
+        //adds a neighbour to a query's heap if it is nearer than the furthest
+        void offer(size_t slot, Number distance, Point *p)
+        {
+            Number *dists = out_dists + slot;
+            if (distance >= dists[0]) return;
+
+            dists[0] = distance;
+            out_ptrs[slot] = p;
+            sift_down(dists, out_ptrs + slot, 0, k);
+        }
+
+        void update_bound(JoinNode *q, const Number *qbox)
+        {
+            JoinBound &b = bound(q);
+            b.furthest = 0;
+            b.nearest = std::numeric_limits<Number>::max();
+
+            JoinQuery *qp = q->pt();
+            for (unsigned int i = 0; i < q->stored(); ++i) {
+                Number kth = out_dists[slot(qp + i)];
+                b.furthest = std::max(b.furthest, kth);
+                b.nearest = std::min(b.nearest, kth);
+            }
+
+            JoinNode *children[2] = {q->left(), q->right()};
+            for (int i = 0; i < 2; ++i) {
+                if (!children[i]) continue;
+                b.furthest = std::max(b.furthest, bound(children[i]).furthest);
+                b.nearest = std::min(b.nearest, bound(children[i]).nearest);
+            }
+
+            //any query in the cell is within the cell's diagonal of the one
+            //with the nearest kth neighbour, and so of its k neighbours
+            if (b.nearest < std::numeric_limits<Number>::max()) {
+                Number diagonal = 0;
+                for (size_t i = 0; i < tree.dim(); ++i) {
+                    diagonal += (qbox[i * 2 + 1] - qbox[i * 2]) * (qbox[i * 2 + 1] - qbox[i * 2]);
+                }
+
+                Number reach = sqrt(b.nearest) + sqrt(diagonal);
+                b.reach = reach * reach;
+            }
+        }
+
+        //the points at q against the points at r
+        void scan(SearchContext &ctx, JoinNode *q, Node *r, const Number *rbox)
+        {
+            Point *p = r->pt();
+            unsigned int stored = r->stored();
+
+            JoinQuery *qp = q->pt();
+            for (unsigned int j = 0; j < q->stored(); ++j) {
+                const Number *qc = coords(qp + j);
+                size_t s = slot(qp + j);
+
+                if (stored > 1 && tree.box_distance(qc, rbox) * max_error >= out_dists[s]) continue;
+
+                if (tree.kernels && stored > 1) {
+                    Number *distances = ctx.distance_buffer(stored);
+                    tree.kernels->block_distance(qc, tree.coords + (p - tree.pts) * tree.dim(),
+                        stored, tree.dim(), distances);
+
+                    for (unsigned int i = 0; i < stored; ++i) offer(s, distances[i], p + i);
+                } else {
+                    for (unsigned int i = 0; i < stored; ++i) {
+                        offer(s, tree.distance(qc, p + i), p + i);
+                    }
+                }
+            }
+        }
+
+        void visit(SearchContext &ctx, JoinNode *q, Number *qbox, Node *r,
+            Number *rbox, Number gap)
+        {
+            if (prune(q, gap)) return;
+
+            if (q->leaf()) {
+                //queries at a leaf descend r together, each while in reach
+                unsigned int active[join_bucket_size];
+                Number cells[join_bucket_size];
+                size_t count = 0;
+
+                JoinQuery *qp = q->pt();
+                for (unsigned int i = 0; i < q->stored(); ++i) {
+                    Number cell = tree.box_distance(coords(qp + i), rbox);
+                    if (cell * max_error < out_dists[slot(qp + i)]) {
+                        active[count] = i;
+                        cells[count++] = cell;
+                    }
+                }
+
+                if (count) descend(ctx, q, r, active, cells, count);
+
+                update_bound(q, qbox);
+                return;
+            }
+
+            scan(ctx, q, r, rbox);
+
+            if (!r->leaf()) {
+
+                //children against children, then the points at each node
+                //against the other's children once bounds have tightened
+                int q_index = 2 * q->axis + 1;
+                Number q_value = qbox[q_index];
+                qbox[q_index] = q->median;
+                if (q->left()) visit_children(ctx, q->left(), qbox, r, rbox);
+                qbox[q_index] = q_value;
+
+                q_index = 2 * q->axis;
+                q_value = qbox[q_index];
+                qbox[q_index] = q->median;
+                if (q->right()) visit_children(ctx, q->right(), qbox, r, rbox);
+                qbox[q_index] = q_value;
+
+                JoinQuery *qp = q->pt();
+                search_children(ctx, qp, coords(qp), r, rbox);
+
+                sweep_children(ctx, r->pt(), q, qbox);
+            } else {
+                int q_index = 2 * q->axis + 1;
+                Number q_value = qbox[q_index];
+                qbox[q_index] = q->median;
+                if (q->left()) visit(ctx, q->left(), qbox, r, rbox, tree.box_gap(qbox, rbox));
+                qbox[q_index] = q_value;
+
+                q_index = 2 * q->axis;
+                q_value = qbox[q_index];
+                qbox[q_index] = q->median;
+                if (q->right()) visit(ctx, q->right(), qbox, r, rbox, tree.box_gap(qbox, rbox));
+                qbox[q_index] = q_value;
+            }
+
+            update_bound(q, qbox);
+        }
+
+        /** The queries at leaf q listed in active, with the squared distances
+            from each to the cell at r, against the subtree at r.  The cells
+            of r's children are reached incrementally as in knn_search, and
+            a query drops out of a child once the cell is out of its reach.
+        */
+        void descend(SearchContext &ctx, JoinNode *q, Node *r,
+            const unsigned int *active, const Number *cells, size_t count)
+        {
+            JoinQuery *qp = q->pt();
+            Point *p = r->pt();
+            unsigned int stored = r->stored();
+
+            for (size_t j = 0; j < count; ++j) {
+                const Number *qc = coords(qp + active[j]);
+                size_t s = slot(qp + active[j]);
+
+                if (tree.kernels && stored > 1) {
+                    Number *distances = ctx.distance_buffer(stored);
+                    tree.kernels->block_distance(qc, tree.coords + (p - tree.pts) * tree.dim(),
+                        stored, tree.dim(), distances);
+
+                    for (unsigned int i = 0; i < stored; ++i) offer(s, distances[i], p + i);
+                } else {
+                    for (unsigned int i = 0; i < stored; ++i) {
+                        offer(s, tree.distance(qc, p + i), p + i);
+                    }
+                }
+            }
+
+            if (r->leaf()) return;
+
+            unsigned int next[join_bucket_size];
+            Number next_cells[join_bucket_size];
+
+            //each query searches the child on its side of the plane before
+            //the other, so the queries go down in up to four groups
+            for (int i = 0; i < 4; ++i) {
+                bool near = i < 2;
+                bool left = i % 2 == 0;
+                Node *child = left ? r->left() : r->right();
+                if (!child) continue;
+
+                size_t next_count = 0;
+                for (size_t j = 0; j < count; ++j) {
+                    Number x = coords(qp + active[j])[r->axis];
+                    if ((x < r->median) != (near == left)) continue;
+
+                    //the far child's cell is as far as the plane (Arya and Mount)
+                    Number cell = cells[j];
+                    if (!near) {
+                        Number cut = x - r->median;
+                        Number offset = x < r->lo ? r->lo - x
+                            : x > r->hi ? x - r->hi : 0;
+                        cell += cut * cut - offset * offset;
+                    }
+
+                    if (cell * max_error < out_dists[slot(qp + active[j])]) {
+                        next[next_count] = active[j];
+                        next_cells[next_count++] = cell;
+                    }
+                }
+
+                if (next_count) descend(ctx, q, child, next, next_cells, next_count);
+            }
+        }
+
+        //q against each child of r, the nearer child first
+        void visit_children(SearchContext &ctx, JoinNode *q, Number *qbox,
+            Node *r, Number *rbox)
+        {
+            int r_index = 2 * r->axis;
+            Number r_lo = rbox[r_index], r_hi = rbox[r_index + 1];
+
+            Number gaps[2] = {0, 0};
+            if (r->left()) {
+                rbox[r_index + 1] = r->median;
+                gaps[0] = tree.box_gap(qbox, rbox);
+                rbox[r_index + 1] = r_hi;
+            }
+            if (r->right()) {
+                rbox[r_index] = r->median;
+                gaps[1] = tree.box_gap(qbox, rbox);
+                rbox[r_index] = r_lo;
+            }
+
+            for (int i = 0; i < 2; ++i) {
+                bool left = (i == 0) == (gaps[0] <= gaps[1]);
+                Node *child = left ? r->left() : r->right();
+                if (!child) continue;
+
+                rbox[r_index + left] = r->median;
+                visit(ctx, q, qbox, child, rbox, gaps[!left]);
+                rbox[r_index] = r_lo;
+                rbox[r_index + 1] = r_hi;
+            }
+        }
+
+        //a query point against the subtree at r, depth first, nearer child first
+        void search(SearchContext &ctx, JoinQuery *qp, const Number *qc,
+            Node *r, Number *rbox)
+        {
+            size_t s = slot(qp);
+            if (tree.box_distance(qc, rbox) * max_error >= out_dists[s]) return;
+
+            Point *p = r->pt();
+            for (unsigned int i = 0; i < r->stored(); ++i) {
+                offer(s, tree.distance(qc, p + i), p + i);
+            }
+
+            if (!r->leaf()) search_children(ctx, qp, qc, r, rbox);
+        }
+
+        void search_children(SearchContext &ctx, JoinQuery *qp, const Number *qc,
+            Node *r, Number *rbox)
+        {
+            int r_index = 2 * r->axis;
+            Number r_lo = rbox[r_index], r_hi = rbox[r_index + 1];
+
+            bool left_first = qc[r->axis] < r->median;
+            for (int i = 0; i < 2; ++i) {
+                bool left = (i == 0) == left_first;
+                Node *child = left ? r->left() : r->right();
+                if (!child) continue;
+
+                rbox[r_index + left] = r->median;
+                search(ctx, qp, qc, child, rbox);
+                rbox[r_index] = r_lo;
+                rbox[r_index + 1] = r_hi;
+            }
+        }
+
+        //a reference point against the queries in the subtree at q
+        void sweep(const Number *rc, Point *p, JoinNode *q, Number *qbox)
+        {
+            if (prune(q, tree.box_distance(rc, qbox))) return;
+
+            JoinQuery *qp = q->pt();
+            for (unsigned int i = 0; i < q->stored(); ++i) {
+                offer(slot(qp + i), tree.distance(coords(qp + i), p), p);
+            }
+
+            if (q->leaf()) {
+                update_bound(q, qbox);
+                return;
+            }
+
+            sweep_children(rc, p, q, qbox);
+        }
+
+        void sweep_children(SearchContext &ctx, Point *p, JoinNode *q, Number *qbox)
+        {
+            sweep_children(ctx.load_query(*p, tree.dim()), p, q, qbox);
+        }
+
+        void sweep_children(const Number *rc, Point *p, JoinNode *q, Number *qbox)
+        {
+            int q_index = 2 * q->axis + 1;
+            Number q_value = qbox[q_index];
+            qbox[q_index] = q->median;
+            if (q->left()) sweep(rc, p, q->left(), qbox);
+            qbox[q_index] = q_value;
+
+            q_index = 2 * q->axis;
+            q_value = qbox[q_index];
+            qbox[q_index] = q->median;
+            if (q->right()) sweep(rc, p, q->right(), qbox);
+            qbox[q_index] = q_value;
+
+            update_bound(q, qbox);
+        }
+
+        const KdTree &tree;
+        const JoinTree &queries;
+        const Point *first;
+        size_t k;
+        double max_error;
+        Point **out_ptrs;
+        Number *out_dists;
+        SearchContext *contexts;
+
+        //per query node, indexed by position in the query tree
+        JoinBound *bounds;
+    };
+
+    /** Joins a query subtree against the whole reference tree.  Large
+        subtrees search the points at their root directly and join each of
+        their children as a separate task, so the tasks write to disjoint
+        queries and query nodes.
+    */
+    struct JoinTask : public ThreadPool::Task {
+
+        typedef typename JoinTree::Node JoinNode;
+
+        JoinTask(KnnJoin &join, JoinNode *q, const Number *qbox)
+            : join(join)
+            , q(q)
+            , qbox(qbox)
+        {
+        }
+
+        void run(ThreadPool &pool)
+        {
+            //read the copy of the reference tree nearest this thread
+            KnnJoin local(join, join.tree.local());
+            const KdTree &tree = local.tree;
+            SearchContext &ctx = join.contexts[pool.thread_index()];
+
+            Region query_region(tree.dim()), reference_region(tree.dim());
+            Number *query_box = query_region.data;
+            Number *reference_box = reference_region.data;
+            std::copy(qbox, qbox + 2 * tree.dim(), query_box);
+            std::copy(tree.bounds, tree.bounds + 2 * tree.dim(), reference_box);
+
+            if (q->count <= join_grain || q->leaf()) {
+                local.visit(ctx, q, query_box, tree.root, reference_box,
+                    tree.box_gap(query_box, reference_box));
+                return;
+            }
+
+            JoinQuery *qp = q->pt();
+            local.search(ctx, qp, local.coords(qp), tree.root, reference_box);
+
+            //the right child works on its own copy of the cell bounds
+            Region right_region(tree.dim());
+            Number *right_box = right_region.data;
+            std::copy(query_box, query_box + 2 * tree.dim(), right_box);
+            right_box[2 * q->axis] = q->median;
+            query_box[2 * q->axis + 1] = q->median;
+
+            ThreadPool::TaskGroup group;
+            JoinTask right(join, q->right(), right_box);
+            if (q->right()) pool.spawn(group, right);
+
+            if (q->left()) {
+                JoinTask left(join, q->left(), query_box);
+                left.run(pool);
+            }
+
+            pool.wait(group);
+        }
+
+        KnnJoin &join;
+        JoinNode *q;
+        const Number *qbox;
+    };
+
+    //sorts the heap of neighbours of each query into increasing distance
+    struct JoinSortBody {
+
+        JoinSortBody(size_t k, Point **out_ptrs, Number *out_dists)
+            : k(k)
+            , out_ptrs(out_ptrs)
+            , out_dists(out_dists)
+        {
+        }
+
+        void operator()(size_t begin, size_t end, size_t)
+        {
+            for (size_t i = begin; i < end; ++i) {
+                Number *dists = out_dists + i * k;
+                Point **ptrs = out_ptrs + i * k;
+
+                for (size_t j = k - 1; j > 0; --j) {
+                    std::swap(dists[0], dists[j]);
+                    std::swap(ptrs[0], ptrs[j]);
+                    sift_down(dists, ptrs, 0, j);
+                }
+            }
+        }
+
+        size_t k;
+        Point **out_ptrs;
+        Number *out_dists;
+    };
+
+    //restores the max-heap order of dists, with ptrs alongside, below i
+    static void sift_down(Number *dists, Point **ptrs, size_t i, size_t length)
+    {
+        while (1) {
+            size_t l = 2 * i + 1;
+            size_t r = l + 1;
+            size_t largest = i;
+
+            if (l < length && dists[l] > dists[largest]) largest = l;
+            if (r < length && dists[r] > dists[largest]) largest = r;
+            if (largest == i) return;
+
+            std::swap(dists[i], dists[largest]);
+            std::swap(ptrs[i], ptrs[largest]);
+            i = largest;
+        }
+    }
+
+    //layout of a saved tree.  sections start on cache line boundaries.
+    struct FileHeader {
+        char magic[8];
+        unsigned int version;
+        unsigned int number_size;
+        unsigned int node_size;
+        unsigned int height;
+        unsigned int split;
+        unsigned int reserved;
+        unsigned long long bucket_size;
+        unsigned long long variance_sample;
+        unsigned long long dim;
+        unsigned long long n;
+        unsigned long long nodes;
+        unsigned long long bounds_offset;
+        unsigned long long nodes_offset;
+        unsigned long long coords_offset;
+        unsigned long long size;
+    };
+
+    static const unsigned int file_version = 5;
+
+    //nodes or coordinates written at a time by save
+    static const size_t file_chunk = 256;
+
+    static const char *file_magic()
+    {
+        return "KDTREE\0";
+    }
+
+    static unsigned long long file_align(unsigned long long offset)
+    {
+        return (offset + 63) & ~63ULL;
+    }
+
+    FileHeader file_header() const
+    {
+        FileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, file_magic(), sizeof(header.magic));
+        header.version = file_version;
+        header.number_size = sizeof(Number);
+        header.node_size = sizeof(Node);
+        header.height = height;
+        header.split = split;
+        header.bucket_size = bucket_size;
+        header.variance_sample = variance_sample;
+        header.dim = dim();
+        header.n = n;
+        header.nodes = arena_offset;
+        header.bounds_offset = file_align(sizeof(header));
+        header.nodes_offset = file_align(header.bounds_offset
+            + (bounds ? 2 * dim() * sizeof(Number) : 0));
+        header.coords_offset = file_align(header.nodes_offset
+            + arena_offset * sizeof(Node));
+        header.size = header.coords_offset + n * dim() * sizeof(Number);
+
+        return header;
+    }
+
+    static bool compatible(const FileHeader &header, size_t size)
+    {
+        return !memcmp(header.magic, file_magic(), sizeof(header.magic))
+            && header.version == file_version
+            && header.number_size == sizeof(Number)
+            && header.node_size == sizeof(Node)
+            && header.split <= SPLIT_SLIDING_MIDPOINT
+            && header.bucket_size
+            && (!Dim || header.dim == Dim)
+            && header.dim * sizeof(Number) == sizeof(Point)
+            && header.size == size
+            && header.nodes_offset + header.nodes * sizeof(Node) <= header.coords_offset
+            && header.coords_offset + header.n * header.dim * sizeof(Number) == size;
+    }
+
+    static bool pad_file(FILE *f, size_t offset)
+    {
+        long pos = ftell(f);
+        if (pos < 0) return false;
+
+        for (; (size_t)pos < offset; ++pos) {
+            if (fputc(0, f) == EOF) return false;
+        }
+
+        return true;
+    }
+
+    //a tree mapped from a file written by save
+    KdTree(const FileHeader &header, char *mapping, size_t mapping_size)
+        : n(header.n)
+        , runtime_dim(header.dim)
+        , arena(0)
+        , arena_offset(header.nodes)
+        , arena_size(0)
+        , height(header.height)
+        , bucket_size(header.bucket_size)
+        , split((SplitRule)header.split)
+        , variance_sample(header.variance_sample)
+        , pts((Point *)(mapping + header.coords_offset))
+        , coords((Number *)(mapping + header.coords_offset))
+        , bounds(header.n ? (Number *)(mapping + header.bounds_offset) : 0)
+        , kernels(0)
+        , mapping(mapping)
+        , mapping_size(mapping_size)
+        , huge_pages(false)
+    {
+        root = header.nodes ? (Node *)(mapping + header.nodes_offset) : 0;
+
+        kernels = &DistanceKernels<Number>::best(dim());
+    }
+
+    //a copy of the nodes and coordinates of source in memory on a NUMA node
+    KdTree(const KdTree &source, int node)
+        : n(source.n)
+        , runtime_dim(source.runtime_dim)
+        , arena(0)
+        , arena_offset(source.arena_offset)
+        , arena_size(source.arena_offset)
+        , height(source.height)
+        , bucket_size(source.bucket_size)
+        , split(source.split)
+        , variance_sample(source.variance_sample)
+        , pts(source.pts)
+        , coords(0)
+        , bounds(0)
+        , kernels(source.kernels)
+        , mapping(0)
+        , mapping_size(0)
+        , huge_pages(source.huge_pages)
+    {
+        if (source.bounds) {
+            bounds = new Number[2 * dim()];
+            std::copy(source.bounds, source.bounds + 2 * dim(), bounds);
+        }
+
+        if (arena_size) {
+            arena = (Node *)allocate(arena_size*sizeof(Node), huge_pages);
+            bind_to_node(arena, allocation_size(arena_size*sizeof(Node), huge_pages), node);
+            memcpy(arena, source.root, arena_size*sizeof(Node));
+
+            //point offsets are relative to the node, so follow the copy
+            long moved = (char *)source.root - (char *)arena;
+            for (size_t i = 0; i < arena_size; ++i) arena[i].pt_offset += moved;
+        }
+
+        if (source.coords) {
+            coords = (Number *)allocate(n*dim()*sizeof(Number), huge_pages);
+            bind_to_node(coords, allocation_size(n*dim()*sizeof(Number), huge_pages), node);
+            memcpy(coords, source.coords, n*dim()*sizeof(Number));
+        }
+
+        root = arena_offset ? arena : 0;
+    }
+
+    size_t n;
+    size_t runtime_dim;
+
+    inline size_t dim() const
+    {
+        return Dim ? Dim : runtime_dim;
+    }
+
+    //dimensions up to which a runtime dimension region fits on the stack
+    static const size_t region_stack_dim = 16;
+
+    //query region scratch space, on the stack unless the dimension is large
+    struct Region {
+
+        Region(size_t dim)
+            : data(Dim || dim <= region_stack_dim ? fixed : new Number[2 * dim])
+        {
+            for (size_t i = 0; i < dim; ++i) {
+                data[i * 2] = -std::numeric_limits<Number>::max();
+                data[i * 2 + 1] = std::numeric_limits<Number>::max();
+            }
+        }
+
+        ~Region()
+        {
+            if (data != fixed) delete[] data;
+        }
+
+        Number fixed[Dim ? 2 * Dim : 2 * region_stack_dim];
+        Number *data;
+    };
+
+    Node *arena;
+    size_t arena_offset;
+    size_t arena_size;
+
+    //levels in the tree, which bounds the stack of a depth first search
+    size_t height;
+
+    size_t bucket_size;
+
+    SplitRule split;
+    size_t variance_sample;
+
+    //input points, reordered by the build so each subtree is contiguous
+    Point *pts;
+
+    //tree-owned copy of the coordinates of pts, if requested
+    Number *coords;
+
+    //bounding box of the root cell
+    Number *bounds;
+
+    //vectorized kernels for coords
+    const DistanceKernels<Number> *kernels;
+
+    //the file this tree was mapped from, if any, which holds everything
+    char *mapping;
+    size_t mapping_size;
+
+    //whether the nodes and coordinates were allocated asking for huge pages
+    bool huge_pages;
+
+    //once replicate_numa has been called, a copy of the tree for each NUMA
+    //node indexed by node, and the node of each cpu
+    std::vector<KdTree *> replicas;
+    std::vector<int> cpu_nodes;
+
+    //the copy of this tree on the NUMA node of the calling thread, if any
+    const KdTree &local() const
+    {
+        if (replicas.empty()) return *this;
+
+        int cpu = sched_getcpu();
+        if (cpu < 0 || (size_t)cpu >= cpu_nodes.size() || cpu_nodes[cpu] < 0) return *this;
+
+        KdTree *replica = replicas[cpu_nodes[cpu]];
+        return replica ? *replica : *this;
+    }
+
+    //reads a list of cpus or nodes, such as 0-3,8-11, from sysfs
+    static bool read_cpu_list(const char *path, std::vector<int> &list)
+    {
+        FILE *f = fopen(path, "r");
+        if (!f) return false;
+
+        int first, last;
+        while (fscanf(f, "%d", &first) == 1) {
+            last = first;
+
+            int c = fgetc(f);
+            if (c == '-') {
+                if (fscanf(f, "%d", &last) != 1) break;
+                c = fgetc(f);
+            }
+
+            for (int i = first; i <= last; ++i) list.push_back(i);
+            if (c != ',') break;
+        }
+
+        fclose(f);
+
+        return !list.empty();
+    }
+
+    //places memory which has not been touched yet on a NUMA node. if the
+    //kernel refuses, the memory is placed as usual.
+    static void bind_to_node(void *p, size_t bytes, int node)
+    {
+        #ifdef SYS_mbind
+        const size_t bits = 8 * sizeof(unsigned long);
+        std::vector<unsigned long> mask(node / bits + 1, 0);
+        mask[node / bits] |= 1UL << (node % bits);
+
+        //MPOL_BIND from <linux/mempolicy.h>
+        const int bind = 2;
+        syscall(SYS_mbind, p, bytes, bind, &mask[0], mask.size() * bits + 1, 0);
+        #endif
+    }
+
+    //smallest dimension for which the vectorized kernels beat a plain loop
+    //on a single point. blocks of points use them in any dimension.
+    static const size_t simd_min_dim = 4;
+
+    //subtrees with fewer points than this are built serially
+    static const size_t parallel_build_cutoff = 1 << 14;
+
+    void build(Point *pts, Number *range, EndBuildFn *fn, const Options &options)
+    {
+        bucket_size = std::max<size_t>(options.bucket_size, 1);
+        split = options.split;
+        variance_sample = std::max<size_t>(options.variance_sample, 2);
+
+        //the root cell is the bounding box of the points, widened to the
+        //caller's range if one was given
+        Number *cell = 0;
+        if (n) {
+            cell = new Number[2 * dim()];
+            bounding_box(pts, n, cell);
+            for (size_t i = 0; range && i < dim(); ++i) {
+                cell[i * 2] = std::min(cell[i * 2], range[i * 2]);
+                cell[i * 2 + 1] = std::max(cell[i * 2 + 1], range[i * 2 + 1]);
+            }
+
+            bounds = new Number[2 * dim()];
+            std::copy(cell, cell + 2 * dim(), bounds);
+        }
+
+        arena_size = subtree_nodes(n);
+        if (arena_size) {
+            arena = (Node *)allocate(arena_size*sizeof(Node), huge_pages);
+            if (options.first_touch && options.pool) {
+                touch_pages(arena, arena_size*sizeof(Node), *options.pool);
+            }
+        }
+
+        if (options.pool && n > parallel_build_cutoff) {
+            BuildTask task(*this, arena, pts, n, 0, options.seed, cell, fn);
+            options.pool->run(task);
+            arena_offset = task.result;
+        } else {
+            arena_offset = build_kdtree(arena, pts, n, 0, options.seed, cell, fn, 0);
+        }
+
+        delete[] cell;
+
+        std::vector<size_t> depths;
+        height = node_depths(depths);
+
+        if (options.layout == LAYOUT_VAN_EMDE_BOAS) van_emde_boas_layout(options, depths);
+
+        root = arena_offset ? arena : 0;
+
+        if (options.copy_coords && n) copy_coordinates(options.pool);
+    }
+
+    //size of the huge pages requested from MAP_HUGETLB
+    static const size_t huge_page_size = 2 << 20;
+
+    //bytes mapped for an allocation, whole huge pages if they may be used
+    static size_t allocation_size(size_t bytes, bool huge)
+    {
+        return huge ? (bytes + huge_page_size - 1) & ~(huge_page_size - 1) : bytes;
+    }
+
+    //anonymous memory for nodes or coordinates, on huge pages if asked
+    static void *allocate(size_t bytes, bool huge)
+    {
+        size_t size = allocation_size(bytes, huge);
+        void *p = MAP_FAILED;
+
+        #ifdef MAP_HUGETLB
+        if (huge) {
+            p = mmap(0, size, PROT_READ|PROT_WRITE,
+                MAP_PRIVATE|MAP_ANON|MAP_HUGETLB, -1, 0);
+        }
+        #endif
+
+        //no huge pages reserved, so ask for transparent ones instead
+        if (p == MAP_FAILED) {
+            p = mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+
+            #ifdef MADV_HUGEPAGE
+            if (huge && p != MAP_FAILED) madvise(p, size, MADV_HUGEPAGE);
+            #endif
+        }
+
+        return p == MAP_FAILED ? 0 : p;
+    }
+
+    static void release(void *p, size_t bytes, bool huge)
+    {
+        munmap(p, allocation_size(bytes, huge));
+    }
+
+    //pages written at a time by each thread when first touching memory
+    static const size_t touch_grain = 512;
+
+    struct TouchBody {
+
+        TouchBody(char *base, size_t page) : base(base), page(page)
+        {
+        }
+
+        void operator()(size_t begin, size_t end, size_t)
+        {
+            for (size_t i = begin; i < end; ++i) base[i * page] = 0;
+        }
+
+        char *base;
+        size_t page;
+    };
+
+    //faults in memory from the threads of pool, so each page is placed on
+    //the NUMA node of the thread which touched it first
+    static void touch_pages(void *p, size_t bytes, ThreadPool &pool)
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+
+        TouchBody body((char *)p, page);
+        pool.parallel_for(0, (bytes + page - 1) / page, touch_grain, body);
+    }
+
+    //points per task when copying coordinates in parallel
+    static const size_t copy_grain = 1 << 16;
+
+    struct CopyBody {
+
+        CopyBody(KdTree &tree) : tree(tree)
+        {
+        }
+
+        void operator()(size_t begin, size_t end, size_t)
+        {
+            Number *c = tree.coords + begin * tree.dim();
+            for (size_t i = begin; i < end; ++i) {
+                for (size_t d = 0; d < tree.dim(); ++d) *c++ = tree.pts[i][d];
+            }
+        }
+
+        KdTree &tree;
+    };
+
+    void copy_coordinates(ThreadPool *pool)
+    {
+        coords = (Number *)allocate(n*dim()*sizeof(Number), huge_pages);
+
+        CopyBody body(*this);
+        if (pool) {
+            pool->parallel_for(0, n, copy_grain, body);
+        } else {
+            body(0, n, 0);
+        }
+
+        kernels = &DistanceKernels<Number>::best(dim());
+    }
+
+    //squared distance from a query to a point of the tree
+    Number distance(const Number *q, const Point *p) const
+    {
+        Number distance = 0;
+
+        if (kernels && dim() >= simd_min_dim) {
+            return kernels->distance(q, coords + (p - pts) * dim(), dim());
+        } else if (coords) {
+            const Number *c = coords + (p - pts) * dim();
+            for (size_t i = 0; i < dim(); ++i) {
+                distance += (c[i] - q[i]) * (c[i] - q[i]);
+            }
+        } else {
+            for (size_t i = 0; i < dim(); ++i) {
+                distance += ((*p)[i] - q[i]) * ((*p)[i] - q[i]);
+            }
+        }
+
+        return distance;
+    }
+
+    //squared distance from q to the nearest point of box
+    Number box_distance(const Number *q, const Number *box) const
+    {
+        Number distance = 0;
+
+        for (size_t i = 0; i < dim(); ++i) {
+            Number offset = q[i] < box[i * 2] ? box[i * 2] - q[i]
+                : q[i] > box[i * 2 + 1] ? q[i] - box[i * 2 + 1] : 0;
+            distance += offset * offset;
+        }
+
+        return distance;
+    }
+
+    //squared distance from q to the farthest corner of box
+    Number far_distance(const Number *q, const Number *box) const
+    {
+        Number distance = 0;
+
+        for (size_t i = 0; i < dim(); ++i) {
+            Number offset = std::max(q[i] - box[i * 2], box[i * 2 + 1] - q[i]);
+            distance += offset * offset;
+        }
+
+        return distance;
+    }
+
+    //squared distance between the nearest points of two boxes
+    Number box_gap(const Number *a, const Number *b) const
+    {
+        Number distance = 0;
+
+        for (size_t i = 0; i < dim(); ++i) {
+            Number offset = a[i * 2] > b[i * 2 + 1] ? a[i * 2] - b[i * 2 + 1]
+                : b[i * 2] > a[i * 2 + 1] ? b[i * 2] - a[i * 2 + 1] : 0;
+            distance += offset * offset;
+        }
+
+        return distance;
+    }
+
+    /** Pseudo-random numbers for pivot selection (splitmix64).  Each
+        subtree seeds its own generator from its parent's seed, so the tree
+        depends only on Options::seed, not on the order subtrees are built in.
+    */
+    struct Random {
+
+        Random(unsigned long long seed) : state(seed)
+        {
+        }
+
+        unsigned long long next()
+        {
+            unsigned long long z = (state += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            return z ^ (z >> 31);
+        }
+
+        size_t below(size_t n)
+        {
+            return next() % n;
+        }
+
+        unsigned long long state;
+    };
+
+    static unsigned long long child_seed(unsigned long long seed, int side)
+    {
+        return Random(seed ^ (side + 1)).next();
+    }
+
+    //the median index used to split a branch of pt_count points
+    static size_t split_index(size_t pt_count)
+    {
+        return (pt_count / 2) >> 1 << 1;
+    }
+
+    //number of nodes in a subtree of pt_count points, if not ended early.
+    //sliding midpoint splits depend on the data, so this is an upper bound.
+    size_t subtree_nodes(size_t pt_count) const
+    {
+        //every node holds at least one point
+        if (bucket_size == 1 || split == SPLIT_SLIDING_MIDPOINT) return pt_count;
+
+        if (pt_count == 0) return 0;
+        if (pt_count <= bucket_size) return 1;
+
+        size_t median_index = split_index(pt_count);
+        return 1 + subtree_nodes(median_index)
+            + subtree_nodes(pt_count - median_index - 1);
+    }
+
+    struct BuildTask : public ThreadPool::Task {
+
+        BuildTask(KdTree &tree, Node *dest, Point *pts, size_t pt_count,
+            size_t depth, unsigned long long seed, Number *range, EndBuildFn *fn)
+            : tree(tree)
+            , dest(dest)
+            , pts(pts)
+            , pt_count(pt_count)
+            , depth(depth)
+            , seed(seed)
+            , range(range)
+            , fn(fn)
+            , result(0)
+        {
+        }
+
+        void run(ThreadPool &pool)
+        {
+            result = tree.build_kdtree(dest, pts, pt_count, depth, seed, range, fn, &pool);
+        }
+
+        KdTree &tree;
+        Node *dest;
+        Point *pts;
+        size_t pt_count;
+        size_t depth;
+        unsigned long long seed;
+        Number *range;
+        EndBuildFn *fn;
+        size_t result;
+    };
+
+    /** Builds the subtree for pts in preorder starting at dest, and returns
+        the number of nodes used.  Child links are relative, so a subtree can
+        be built anywhere and moved afterwards.  If pool is set, the right
+        subtree is built as a separate task at the position it would occupy
+        if the left subtree were complete, and is moved down afterwards if
+        fn ended the left subtree early, so the layout matches a serial build.
+    */
+    size_t build_kdtree(Node *dest, Point *pts, size_t pt_count, size_t depth,
+        unsigned long long seed, Number *range, EndBuildFn *fn, ThreadPool *pool)
+    {
+        if (pt_count == 0) {
+            //empty branch
+            return 0;
+        }
+
+        Node *result = new (dest) Node;
+
+        if (pt_count <= bucket_size) {
+            //leaf node, store bucket of points and return
+            result->set_pt(pts);
+            result->count = pt_count;
+            result->median = 0;
+            result->left_offset = result->right_offset = 0;
+            if (fn) (*fn)(result, range);
+            return 1;
+        }
+
+        //choose split (has side effect of partitioning input array around it)
+        Random rng(seed);
+        Number median;
+        size_t median_index = split_branch(pts, pt_count, depth, rng, range,
+            result->axis, median);
+
+        //store point and median value
+        result->set_pt(&pts[median_index]);
+        result->count = 1;
+        result->median = median;
+        result->left_offset = result->right_offset = 0;
+        result->lo = range[result->axis * 2];
+        result->hi = range[result->axis * 2 + 1];
+
+        //if not terminal, recursively build tree
+        if (fn && (*fn)(result, range)) return 1;
+
+        Point *right_pts = &pts[median_index + 1];
+        size_t right_count = pt_count - median_index - 1;
+        size_t range_coord = result->axis * 2;
+
+        size_t left_nodes, right_nodes;
+        Node *right;
+
+        if (pool && pt_count > parallel_build_cutoff) {
+
+            //right subtree works on its own copy of the cell bounds
+            Number *right_range = new Number[2 * dim()];
+            std::copy(range, range + 2 * dim(), right_range);
+            right_range[range_coord] = median;
+
+            ThreadPool::TaskGroup group;
+            size_t left_max = subtree_nodes(median_index);
+
+            BuildTask task(*this, dest + 1 + left_max, right_pts,
+                right_count, depth + 1, child_seed(seed, 1), right_range, fn);
+            pool->spawn(group, task);
+
+            left_nodes = build_left(dest + 1, pts, median_index, depth + 1,
+                child_seed(seed, 0), range, range_coord, median, fn, pool);
+
+            pool->wait(group);
+            delete[] right_range;
+
+            right_nodes = task.result;
+            right = dest + 1 + left_nodes;
+            if (left_nodes < left_max && right_nodes) {
+                memmove(right, dest + 1 + left_max, right_nodes * sizeof(Node));
+
+                //point offsets are relative to the node, so follow the move
+                long moved = (left_max - left_nodes) * sizeof(Node);
+                for (size_t i = 0; i < right_nodes; ++i) right[i].pt_offset += moved;
+            }
+        } else {
+            left_nodes = build_left(dest + 1, pts, median_index, depth + 1,
+                child_seed(seed, 0), range, range_coord, median, fn, pool);
+
+            right = dest + 1 + left_nodes;
+
+            Number t = range[range_coord];
+            range[range_coord] = median;
+            right_nodes = build_kdtree(right, right_pts, right_count,
+                depth + 1, child_seed(seed, 1), range, fn, pool);
+            range[range_coord] = t;
+        }
+
+        if (left_nodes) result->count += dest[1].count;
+        if (right_nodes) result->count += right->count;
+        else right = result;
+
+        if (left_nodes) result->left_offset = 1;
+        result->right_offset = right - result;
+
+        return 1 + left_nodes + right_nodes;
+    }
+
+    //finds the depth of each node, from 1 at the root, and returns the
+    //height of the tree. in preorder a node's depth is set before it is
+    //reached.
+    size_t node_depths(std::vector<size_t> &depths) const
+    {
+        if (!arena_offset) return 0;
+
+        depths.resize(arena_offset);
+        depths[0] = 1;
+
+        size_t levels = 0;
+        for (size_t i = 0; i < arena_offset; ++i) {
+            const Node &node = arena[i];
+            if (node.left_offset) depths[i + node.left_offset] = depths[i] + 1;
+            if (node.right_offset) depths[i + node.right_offset] = depths[i] + 1;
+            levels = std::max(levels, depths[i]);
+        }
+
+        return levels;
+    }
+
+    /** Moves the nodes, built in preorder, into van Emde Boas order.  The
+        new position of every node is found first, so that its child and
+        point offsets can be rewritten relative to where it will be, and the
+        nodes are then copied to a new arena, which is much faster than
+        permuting them in place but briefly needs room for both.
+    */
+    void van_emde_boas_layout(const Options &options, std::vector<size_t> &order)
+    {
+        if (arena_offset < 3) return;
+
+        //the depths of the nodes are replaced by their new positions
+        std::vector<Node *> scratch;
+        size_t next = 0;
+        place_van_emde_boas(arena, height, &order[0], next, scratch);
+
+        Node *fresh = (Node *)allocate(arena_size*sizeof(Node), huge_pages);
+        if (options.first_touch && options.pool) {
+            touch_pages(fresh, arena_size*sizeof(Node), *options.pool);
+        }
+
+        for (size_t i = 0; i < arena_offset; ++i) {
+            Node &node = fresh[order[i]];
+            node = arena[i];
+
+            long to = order[i];
+            if (node.left_offset) node.left_offset = order[i + node.left_offset] - to;
+            if (node.right_offset) node.right_offset = order[i + node.right_offset] - to;
+            node.pt_offset += (char *)&arena[i] - (char *)&node;
+        }
+
+        release(arena, arena_size*sizeof(Node), huge_pages);
+        arena = fresh;
+    }
+
+    //numbers the nodes in the first height levels under node in van Emde
+    //Boas order starting at next. the bottom trees of each level are
+    //gathered onto the end of scratch, which is shared by every level.
+    void place_van_emde_boas(Node *node, size_t height, size_t *order,
+        size_t &next, std::vector<Node *> &scratch)
+    {
+        if (height == 1) {
+            order[node - arena] = next++;
+            return;
+        }
+
+        size_t top = height / 2;
+        place_van_emde_boas(node, top, order, next, scratch);
+
+        //roots of the bottom trees, top levels down, from left to right
+        size_t begin = scratch.size();
+        scratch.push_back(node);
+        for (size_t level = 0; level < top; ++level) {
+            size_t end = scratch.size();
+            for (size_t i = begin; i < end; ++i) {
+                Node *n = scratch[i];
+                if (n->left()) scratch.push_back(n->left());
+                if (n->right()) scratch.push_back(n->right());
+            }
+            scratch.erase(scratch.begin() + begin, scratch.begin() + end);
+        }
+
+        for (size_t i = begin; i < scratch.size(); ++i) {
+            place_van_emde_boas(scratch[i], height - top, order, next, scratch);
+        }
+        scratch.resize(begin);
+    }
+
+    size_t build_left(Node *dest, Point *pts, size_t pt_count, size_t depth,
+        unsigned long long seed, Number *range, size_t range_coord,
+        Number median, EndBuildFn *fn, ThreadPool *pool)
+    {
+        Number t = range[range_coord + 1];
+        range[range_coord + 1] = median;
+
+        size_t nodes = build_kdtree(dest, pts, pt_count, depth, seed, range, fn, pool);
+
+        range[range_coord + 1] = t;
+
+        return nodes;
+    }
+
+    /** Chooses the axis and value to split a branch at, and partitions pts
+        so that the points before the returned index are no greater than the
+        split value along the axis, and those after it are no less.  The
+        point at the returned index is stored in the branch node.
+    */
+    size_t split_branch(Point *pts, size_t pt_count, size_t depth,
+        Random &rng, Number *cell, int &axis, Number &median)
+    {
+        switch (split) {
+        case SPLIT_SLIDING_MIDPOINT:
+            return sliding_midpoint(pts, pt_count, cell, axis, median);
+        case SPLIT_MAX_SPREAD:
+            axis = max_spread_axis(pts, pt_count);
+            break;
+        case SPLIT_MAX_VARIANCE:
+            axis = max_variance_axis(pts, pt_count);
+            break;
+        default:
+            axis = depth % dim();
+        }
+
+        size_t median_index = split_index(pt_count);
+        median = select_order(median_index, pts, pt_count, axis, rng);
+
+        return median_index;
+    }
+
+    void bounding_box(Point *pts, size_t pt_count, Number *box) const
+    {
+        for (size_t d = 0; d < dim(); ++d) {
+            box[d * 2] = box[d * 2 + 1] = pts[0][d];
+        }
+
+        for (size_t i = 1; i < pt_count; ++i) {
+            for (size_t d = 0; d < dim(); ++d) {
+                Number c = pts[i][d];
+                if (c < box[d * 2]) box[d * 2] = c;
+                if (c > box[d * 2 + 1]) box[d * 2 + 1] = c;
+            }
+        }
+    }
+
+    Number spread(Point *pts, size_t pt_count, size_t axis) const
+    {
+        Number lo = pts[0][axis], hi = lo;
+        for (size_t i = 1; i < pt_count; ++i) {
+            Number c = pts[i][axis];
+            if (c < lo) lo = c;
+            if (c > hi) hi = c;
+        }
+
+        return hi - lo;
+    }
+
+    int max_spread_axis(Point *pts, size_t pt_count) const
+    {
+        int axis = 0;
+        Number max_spread = -1;
+
+        for (size_t d = 0; d < dim(); ++d) {
+            Number s = spread(pts, pt_count, d);
+            if (s > max_spread) {
+                max_spread = s;
+                axis = d;
+            }
+        }
+
+        return axis;
+    }
+
+    int max_variance_axis(Point *pts, size_t pt_count) const
+    {
+        //evenly spaced sample, so the choice does not depend on the order
+        //the points arrive in beyond their positions
+        size_t samples = std::min(pt_count, variance_sample);
+        size_t stride = pt_count / samples;
+
+        int axis = 0;
+        double max_variance = -1;
+
+        for (size_t d = 0; d < dim(); ++d) {
+            double sum = 0, sum_sq = 0;
+            for (size_t i = 0; i < samples; ++i) {
+                double c = pts[i * stride][d];
+                sum += c;
+                sum_sq += c * c;
+            }
+
+            double mean = sum / samples;
+            double variance = sum_sq / samples - mean * mean;
+            if (variance > max_variance) {
+                max_variance = variance;
+                axis = d;
+            }
+        }
+
+        return axis;
+    }
+
+    size_t sliding_midpoint(Point *pts, size_t pt_count, Number *cell,
+        int &axis, Number &cut)
+    {
+        //longest side of the cell
+        Number max_length = 0;
+        for (size_t d = 0; d < dim(); ++d) {
+            max_length = std::max(max_length, cell[d * 2 + 1] - cell[d * 2]);
+        }
+
+        //of the sides close to the longest, the one the points spread most along
+        Number max_spread = -1;
+        axis = 0;
+        for (size_t d = 0; d < dim(); ++d) {
+            if (cell[d * 2 + 1] - cell[d * 2] >= (1 - 1e-3) * max_length) {
+                Number s = spread(pts, pt_count, d);
+                if (s > max_spread) {
+                    max_spread = s;
+                    axis = d;
+                }
+            }
         }
 
-        //run query
-        std::vector<Point *> qr = range_search(root, range, region, 0);
+        Number lo = pts[0][axis], hi = lo;
+        for (size_t i = 1; i < pt_count; ++i) {
+            Number c = pts[i][axis];
+            if (c < lo) lo = c;
+            if (c > hi) hi = c;
+        }
 
-        //clean up and return result;
-        delete[] region;
+        //slide the midpoint to the nearest point if it misses them all
+        Number ideal = cell[axis * 2] + (cell[axis * 2 + 1] - cell[axis * 2]) / 2;
+        cut = ideal < lo ? lo : ideal > hi ? hi : ideal;
 
-        return qr;
+        size_t below, below_or_equal;
+        plane_split(pts, pt_count, axis, cut, below, below_or_equal);
 
+        //keep the split as even as ties at the cut allow
+        if (ideal < lo) return 1;
+        if (ideal > hi) return pt_count - 1;
+        if (below > pt_count / 2) return below;
+        if (below_or_equal < pt_count / 2) return below_or_equal;
+        return pt_count / 2;
     }
 
-    size_t range_count(Number *range)
+    //partitions pts into those below, equal to and above value along axis
+    void plane_split(Point *pts, size_t pt_count, size_t axis, Number value,
+        size_t &below, size_t &below_or_equal)
     {
-        //set up region
-        Number *region = new Number[2 * dim];
-        for (int i = 0; i < dim; ++i) {
-            region[i] = -std::numeric_limits<Number>::max();
-            region[i + 1] = std::numeric_limits<Number>::max();
+        size_t l = 0, r = pt_count;
+        while (l < r) {
+            if (pts[l][axis] < value) {
+                ++l;
+            } else {
+                --r;
+                std::swap(pts[l], pts[r]);
+            }
         }
+        below = l;
 
-        //run query
-        size_t qr = range_count(root, range, region, 0);
-
-        //clean up and return result;
-        delete[] region;
+        r = pt_count;
+        while (l < r) {
+            if (pts[l][axis] == value) {
+                ++l;
+            } else {
+                --r;
+                std::swap(pts[l], pts[r]);
+            }
+        }
+        below_or_equal = l;
+    }
 
-        return qr;
+    //ranges this small are finished off with an insertion sort
+    static const size_t select_cutoff = 16;
 
-    }
+    //ranges larger than this take their pivot from a sample
+    static const size_t sample_cutoff = 600;
 
-    /** This function searches for the k nearest neighbours to a query point.
+    /** Rearranges pts so that pts[i] holds the point with the i'th smallest
+        coordinate along coord, with no greater coordinates before it and no
+        smaller ones after, and returns that coordinate.
 
-        \param k The number of nearest neighbours to find.
-        \param pt The point for which to find the nearest neighbour.
-        \param eps The epsilon for approximate nearest neighbour searches.
-        \return A list containing points and distances of the k nearest neighbours
-                to the query point.
+        This is introselect: quickselect with pivots sampled close to the
+        wanted rank (Floyd and Rivest) for large ranges and a median of three
+        random points for smaller ones, falling back to median of medians
+        pivots if the range is not shrinking quickly enough, so the worst
+        case stays linear.
     */
-    std::list<std::pair<Point *, Number> > knn(size_t k, const Point &pt, Number eps)
+    Number select_order(size_t i, Point *pts, size_t pt_count, size_t coord,
+        Random &rng)
     {
-        FixedSizePriorityQueue<Node *> pq(k);
+        size_t start = 0;
+        size_t end = pt_count;
+
+        //allow twice the expected number of rounds before switching pivots
+        size_t budget = 8;
+        for (size_t c = pt_count; c > 1; c >>= 1) budget += 2;
+
+        while (end - start > select_cutoff) {
+
+            size_t pivot;
+            if (budget) {
+                --budget;
+                if (end - start > sample_cutoff) {
+                    pivot = sample_pivot(i, pts, start, end, coord, rng);
+                } else {
+                        pivot = median_of_three(pts, coord,
+                        start + rng.below(end - start),
+                        start + rng.below(end - start),
+                        start + rng.below(end - start));
+                }
+            } else {
+                pivot = median_of_medians(pts, start, end, coord, rng);
+            }
 
-        knn_search(pq, pt, eps);
+            size_t split = partition(pts, start, end, coord, pivot);
 
-        std::list<std::pair<Point *, Number> > qr;
-        while(pq.length) {
-            typename FixedSizePriorityQueue<Node *>::Entry e = pq.pop();
-            qr.push_front(std::make_pair(e.data->pt, e.priority));
+            if (i <= split) {
+                end = split + 1;
+            } else {
+                start = split + 1;
+            }
         }
 
-        return qr;
-    }
+        insertion_sort(pts, start, end, coord);
 
-    /** This function searches for the k nearest neighbours to a query point.
-        It takes an initial set of nodes which may be nearest neighbours
-        of the query point, which potentially reduces how much of the tree
-        must be searched.
+        return pts[i][coord];
+    }
 
-        \param pq A priority queue containing potential nearest neighbours to the
-                  query point.
-        \param pt The point for which to find the nearest neighbour.
-        \param eps The epsilon for approximate nearest neighbour searches.
-        \return A list containing points and distances of the k nearest neighbours
-                to the query point.
+    /** Selects, within a window of about n^(2/3) points around rank i, the
+        point of rank i, and returns its index for use as a pivot.  The window
+        is offset so the pivot is likely to land just past i, leaving i in the
+        small side of the following partition.
     */
-    std::list<std::pair<Point *, Number> > knn(FixedSizePriorityQueue<Node *> &pq, const Point &pt, Number eps)
+    size_t sample_pivot(size_t i, Point *pts, size_t start, size_t end,
+        size_t coord, Random &rng)
     {
-        knn_search(pq, pt, eps);
+        double n = end - start;
+        double k = i - start;
+        double z = log(n);
+        double s = 0.5 * exp(2.0 * z / 3.0);
+        double sd = 0.5 * sqrt(z * s * (n - s) / n) * (k < n / 2 ? -1.0 : 1.0);
 
-        std::list<std::pair<Point *, Number> > qr;
-        while(pq.length) {
-            typename FixedSizePriorityQueue<Node *>::Entry e = pq.pop();
-            qr.push_front(std::make_pair(e.data->pt, e.priority));
-        }
+        size_t lo = (size_t)std::max(0.0, k - k * s / n + sd);
+        size_t hi = (size_t)std::min(n - 1.0, k + (n - k) * s / n + sd);
 
-        return qr;
-    }
+        select_order(i - start - lo, pts + start + lo, hi - lo + 1, coord, rng);
 
-    /** This function searches for a single exact nearest neighbour and returns
-        the Node containing it.  This is useful for building caches on top of
-        the kd-tree.
+        return i;
+    }
 
-        \param pt The point for which to find the nearest neighbour.
-        \return The Node containing the nearest neighbour.
-    */
-    Node *nn(const Point &pt)
+    size_t median_of_three(Point *pts, size_t coord, size_t a, size_t b, size_t c) const
     {
-        FixedSizePriorityQueue<Node *> pq(1);
-        knn_search(pq, root, pt, 0.0, 0);
-        typename FixedSizePriorityQueue<Node *>::Entry e = pq.pop();
-        return e.data;
+        Number x = pts[a][coord], y = pts[b][coord], z = pts[c][coord];
+
+        if (x < y) {
+            if (y < z) return b;
+            return x < z ? c : a;
+        } else {
+            if (x < z) return a;
+            return y < z ? c : b;
+        }
     }
 
-    /** This function searches for the node containing a query point.
-        Since we don't track the bounds of the original point set, this will
-        return incorrect results if the query point is outside of the bounds
-        of the kd-tree.
+    //returns the index of a pivot guaranteed to be near the middle of [start, end)
+    size_t median_of_medians(Point *pts, size_t start, size_t end, size_t coord,
+        Random &rng)
+    {
+        //move the median of each group of five to the front
+        size_t groups = 0;
+        for (size_t g = start; g < end; g += 5) {
+            size_t g_end = std::min(g + 5, end);
+            insertion_sort(pts, g, g_end, coord);
+            std::swap(pts[start + groups], pts[g + (g_end - g) / 2]);
+            ++groups;
+        }
 
-        \param pt The point for which to locate the node.
-        \return The Node containing the query point.
+        //and select the median of those
+        select_order(groups / 2, pts + start, groups, coord, rng);
+
+        return start + groups / 2;
+    }
+
+    /** Hoare partition of [start, end) around the value of pts[pivot].
+        Returns split such that coordinates in [start, split] are no greater
+        than the pivot value and those in (split, end) are no less, with both
+        sides nonempty.  Points equal to the pivot stop both scans, so
+        duplicates end up spread over both sides rather than piling up.
     */
-    Node *locate(const Point &pt)
+    size_t partition(Point *pts, size_t start, size_t end, size_t coord,
+        size_t pivot)
     {
-        Node *node = root;
+        std::swap(pts[start], pts[pivot]);
+        Number value = pts[start][coord];
 
-        size_t depth = 1;
+        size_t i = start;
+        size_t j = end - 1;
 
-        while (node->children) {
+        while (1) {
+            while (pts[j][coord] > value) --j;
+            while (pts[i][coord] < value) ++i;
 
-            if (pt[depth % dim] < node->median) {
-                node = node->left();
-            } else {
-                node = node->right();
-            }
+            if (i >= j) return j;
 
-            ++depth;
+            std::swap(pts[i], pts[j]);
+            ++i;
+            --j;
         }
+    }
 
-        return node;
+    void insertion_sort(Point *pts, size_t start, size_t end, size_t coord)
+    {
+        for (size_t i = start + 1; i < end; ++i) {
+            for (size_t j = i; j > start && pts[j][coord] < pts[j - 1][coord]; --j) {
+                std::swap(pts[j], pts[j - 1]);
+            }
+        }
     }
 
-    Node *root;
+    int point_in_range(Point *p, Number *range) const
+    {
+        if (kernels && dim() >= simd_min_dim) {
+            return kernels->in_range(coords + (p - pts) * dim(), range, dim());
+        } else if (coords) {
+            const Number *c = coords + (p - pts) * dim();
+            for (size_t i = 0; i < dim(); ++i) {
+                if (range[i*2] > c[i] || range[i*2+1] < c[i]) return 0;
+            }
 
-    #ifdef KDTREE_COLLECT_KNN_STATS
-    int knn_nodes_visited;
-    #endif
+            return 1;
+        }
 
-private:
+        for (size_t i = 0; i < dim(); ++i) {
+            if (range[i*2] > (*p)[i] || range[i*2+1] < (*p)[i]) return 0;
+        }
 
-    size_t n;
-    size_t dim;
+        return 1;
+    }
 
-    Node *arena;
-    size_t arena_offset;
+    int range_contains_region(Number *range, Number *region) const
+    {
+        for (size_t i = 0; i < dim(); ++i) {
+            if (range[i*2] > region[i*2] || range[i*2+1] < region[i*2+1]) return 0;
+        }
 
-    PriorityQueue<Node *> searchpq;
+        return 1;
+    }
 
-    Node *build_kdtree(Point *pts, size_t pt_count, size_t depth)
+    int region_intersects_range(Number *region, Number *range) const
     {
-        Node *result = 0;
-
-        if (pt_count == 0) {
-            //empty branch
-        } else if (pt_count == 1) {
-            //leaf node, store point and return
-            result = new (arena + arena_offset) Node;
-            ++arena_offset;
-            result->pt = pts;
-            result->median = 0;
-            result->children = 0;
-        } else {
+        for (size_t i = 0; i < dim(); ++i) {
+            if (range[i*2] > region[i*2+1] || range[i*2+1] < region[i*2]) return 0;
+        }
 
-            result = new (arena + arena_offset) Node;
-            ++arena_offset;
+        return 1;
+    }
 
-            //branch coordinate
-            result->axis = depth % dim;
+    struct Appender {
 
-            //find median (has side effect of partitioning input array around median)
-            size_t median_index = (pt_count / 2) >> 1 << 1;
-            Number median = select_order(median_index, pts, pt_count, result->axis);
+        Appender(std::vector<Point *> &qr) : qr(qr)
+        {
+        }
 
-            //recursively build tree
-            result->children = 0;
-            Node *left = build_kdtree(pts, median_index, depth + 1);
-            Node *right = build_kdtree(&pts[median_index + 1],
-                pt_count - median_index - 1, depth + 1);
+        void operator()(Point *pt)
+        {
+            qr.push_back(pt);
+        }
 
-            result->children = (Node *)(right - result);
-            if (left) result->children = (Node *)((long)result->children | 0xA0000000);
+        std::vector<Point *> &qr;
+    };
 
-            //store point and median value
-            result->pt = &pts[median_index];
-            result->median = median;
-        }
+    template<class Visitor> void report_subtree(Node *tree, Visitor &visitor) const
+    {
+        for (unsigned int i = 0; i < tree->stored(); ++i) visitor(tree->pt() + i);
 
-        return result;
+        //recurse through tree
+        if (tree->left()) report_subtree(tree->left(), visitor);
+        if (tree->right()) report_subtree(tree->right(), visitor);
     }
 
 
-    Node *build_kdtree(Point *pts, size_t pt_count, size_t depth,
-        Number *range, EndBuildFn &fn)
+    template<class Visitor, class Stats> void range_visit(Node *tree,
+        Number *range, Number *region, Visitor &visitor, Stats &stats) const
     {
-        Node *result = 0;
+        ++stats.nodes_visited;
+        stats.distances += tree->stored();
 
-        if (pt_count == 0) {
-            //empty branch
-        } else if (pt_count == 1) {
-            //leaf node, store point and return
-            result = new (arena + arena_offset) Node;
-            ++arena_offset;
-            result->pt = pts;
-            result->median = 0;
-            result->children = 0;
-            fn(result, range);
-        } else {
+        //points stored at this node
+        for (unsigned int i = 0; i < tree->stored(); ++i) {
+            if (point_in_range(tree->pt() + i, range)) visitor(tree->pt() + i);
+        }
 
-            result = new (arena + arena_offset) Node;
-            ++arena_offset;
+        //leaf node
+        if (tree->leaf()) return;
 
-            //branch coordinate
-            result->axis = depth % dim;
+        Number split_value = tree->median;
 
-            //find median (has side effect of partitioning input array around median)
-            size_t median_index = (pt_count / 2) >> 1 << 1;
-            Number median = select_order(median_index, pts, pt_count, result->axis);
+        //left subtree -- update region
+        int changed_index = 2 * tree->axis + 1;
 
-            //store point and median value
-            result->pt = &pts[median_index];
-            result->median = median;
-            result->children = 0;
+        Number changed_value = region[changed_index];
+        region[changed_index] = split_value;
 
-            //if not terminal, recursively build tree
-            if (!fn(result, range)) {
-                double t;
-                size_t range_coord = (depth%dim)*2;
+        if (tree->left()) {
+            if (range_contains_region(range, region)) {
+                ++stats.contained;
+                report_subtree(tree->left(), visitor);
+            } else if (region_intersects_range(region, range)) {
+                ++stats.intersected;
+                range_visit(tree->left(), range, region, visitor, stats);
+            } else {
+                ++stats.pruned;
+            }
+        }
 
-                t = range[range_coord+1];
-                range[range_coord+1] = result->median;
-                Node *left = build_kdtree(pts, median_index, depth + 1, range, fn);
-                range[range_coord+1] = t;
+        //restore region
+        region[changed_index] = changed_value;
 
-                t = range[range_coord];
-                range[range_coord] = result->median;
-                Node *right = build_kdtree(&pts[median_index + 1],
-                    pt_count - median_index - 1, depth + 1, range, fn);
-                range[range_coord] = t;
+        //right subtree -- update region
+        changed_index = 2 * tree->axis;
+        changed_value = region[changed_index];
+        region[changed_index] = split_value;
 
-                result->children = (Node *)(right - result);
-                if (left) result->children = (Node *)((long)result->children | 0xA0000000);
+        if (tree->right()) {
+            if (range_contains_region(range, region)) {
+                ++stats.contained;
+                report_subtree(tree->right(), visitor);
+            } else if (region_intersects_range(region, range)) {
+                ++stats.intersected;
+                range_visit(tree->right(), range, region, visitor, stats);
+            } else {
+                ++stats.pruned;
             }
-
         }
 
-        return result;
+        //restore region
+        region[changed_index] = changed_value;
     }
 
-    size_t partition(size_t start, size_t end, Point *pts, size_t coord)
+    template<class Stats> size_t range_count(Node *tree, Number *range,
+        Number *region, Stats &stats) const
     {
-        //choose pivot and place at end
-        size_t pivot = start + rand() % (end - start);
-        std::swap(pts[pivot], pts[end]);
+        size_t qr = 0;
 
-        //get pivot value
-        Number value = pts[end][coord];
+        ++stats.nodes_visited;
+        stats.distances += tree->stored();
 
-        //move values around pivot
-        size_t i = start;
-        for (size_t j = start; j < end; ++j) {
-            if (pt_lt(coord, pts[j], pts[end])) {
-                std::swap(pts[i], pts[j]);
-                ++i;
-            }
+        //points stored at this node
+        for (unsigned int i = 0; i < tree->stored(); ++i) {
+            if (point_in_range(tree->pt() + i, range)) ++qr;
         }
 
-        std::swap(pts[i], pts[end]);
+        //leaf node
+        if (tree->leaf()) return qr;
 
-        return i;
-    }
+        Number split_value = tree->median;
 
-    Number select_order(size_t i, Point *pts, size_t pt_count, size_t coord)
-    {
-        size_t start = 0;
-        size_t end = pt_count - 1;
+        //left subtree -- update region
+        int changed_index = 2 * tree->axis + 1;
 
-        while (1) {
+        Number changed_value = region[changed_index];
+        region[changed_index] = split_value;
 
-            if (start == end) return pts[start][coord];
+        if (tree->left()) {
+            if (range_contains_region(range, region)) {
+                ++stats.contained;
+                qr += tree->left()->count;
+            } else if (region_intersects_range(region, range)) {
+                ++stats.intersected;
+                qr += range_count(tree->left(), range, region, stats);
+            } else {
+                ++stats.pruned;
+            }
+        }
+
+        //restore region
+        region[changed_index] = changed_value;
 
-            size_t pivot = partition(start, end, pts, coord);
+        //right subtree -- update region
+        changed_index = 2 * tree->axis;
+        changed_value = region[changed_index];
+        region[changed_index] = split_value;
 
-            if (i == pivot) {
-                return pts[pivot][coord];
-            } else if (i < pivot) {
-                end = pivot - 1;
+        if (tree->right()) {
+            if (range_contains_region(range, region)) {
+                ++stats.contained;
+                qr += tree->right()->count;
+            } else if (region_intersects_range(region, range)) {
+                ++stats.intersected;
+                qr += range_count(tree->right(), range, region, stats);
             } else {
-                start = pivot + 1;
+                ++stats.pruned;
             }
         }
-    }
 
-    int pt_lt(size_t coord, const Point &a, const Point &b) const
-    {
-        //if points are unequal, do direct comparison
-        if (a[coord] != b[coord]) {
-            return a[coord] < b[coord];
-        } else {
-            //otherwise, compare in lexicographic order
-            size_t i = (coord + 1) % dim;
-            while (a[i] == b[i] && i != coord) i = (i + 1) % dim;
-            return a[i] <= b[i];
-        }
+        //restore region
+        region[changed_index] = changed_value;
+
+        return qr;
     }
 
-    int point_in_range(Point *p, Number *range)
+    //region starts as the root cell, query as a copy of pt
+    void start_radius_query(const Point &pt, Number *region, Number *query) const
     {
-        for (int i = 0; i < dim; ++i) {
-            if (range[i*2] > (*p)[i] || range[i*2+1] < (*p)[i]) return 0;
-        }
-
-        return 1;
+        std::copy(bounds, bounds + 2 * dim(), region);
+        for (size_t i = 0; i < dim(); ++i) query[i] = pt[i];
     }
 
-    int range_contains_region(Number *range, Number *region)
+    template<class Visitor, class Stats> void radius_visit(Node *tree,
+        const Number *query, Number r2, Number *region, Visitor &visitor,
+        Stats &stats) const
     {
-        for (int i = 0; i < dim; ++i) {
-            if (range[i*2] > region[i*2] || range[i*2+1] < region[i*2+1]) return 0;
-            if (range[i*2] > region[i*2+1] || range[i*2+1] < region[i*2]) return 0;
+        ++stats.nodes_visited;
+        stats.distances += tree->stored();
+
+        //points stored at this node
+        for (unsigned int i = 0; i < tree->stored(); ++i) {
+            if (distance(query, tree->pt() + i) <= r2) visitor(tree->pt() + i);
         }
 
-        return 1;
-    }
+        //leaf node
+        if (tree->leaf()) return;
 
-    int region_intersects_range(Number *range, Number *region)
-    {
-        int intersects = 0;
-        for (int i = 0; i < dim; ++i) {
-            if (range[i*2] < region[i*2] || range[i*2+1] > region[i*2+1]) intersects = 1;
-            if (range[i*2] < region[i*2+1] || range[i*2+1] > region[i*2]) intersects = 1;
-        }
+        Number split_value = tree->median;
 
-        return intersects;
-    }
+        //left subtree -- update region
+        int changed_index = 2 * tree->axis + 1;
 
-    void report_subtree(Node *tree, std::vector<Point *> &qr)
-    {
-        qr.push_back(tree->pt);
+        Number changed_value = region[changed_index];
+        region[changed_index] = split_value;
 
-        //recurse through tree
-        if (tree->left()) report_subtree(tree->left(), qr);
-        if (tree->right()) report_subtree(tree->right(), qr);
-    }
+        if (tree->left()) {
+            if (box_distance(query, region) > r2) {
+                ++stats.pruned;
+            } else if (far_distance(query, region) <= r2) {
+                ++stats.contained;
+                report_subtree(tree->left(), visitor);
+            } else {
+                ++stats.intersected;
+                radius_visit(tree->left(), query, r2, region, visitor, stats);
+            }
+        }
 
-    size_t report_subtree(Node *tree)
-    {
-        size_t result = 1;
+        //restore region
+        region[changed_index] = changed_value;
 
-        //recurse through tree
-        if (tree->left()) result += report_subtree(tree->left());
-        if (tree->right()) result += report_subtree(tree->right());
+        //right subtree -- update region
+        changed_index = 2 * tree->axis;
+        changed_value = region[changed_index];
+        region[changed_index] = split_value;
 
-        return result;
-    }
+        if (tree->right()) {
+            if (box_distance(query, region) > r2) {
+                ++stats.pruned;
+            } else if (far_distance(query, region) <= r2) {
+                ++stats.contained;
+                report_subtree(tree->right(), visitor);
+            } else {
+                ++stats.intersected;
+                radius_visit(tree->right(), query, r2, region, visitor, stats);
+            }
+        }
 
+        //restore region
+        region[changed_index] = changed_value;
+    }
 
-    std::vector<Point *> range_search(Node *tree, Number *range, Number *region, size_t depth)
+    template<class Stats> size_t radius_count(Node *tree, const Number *query,
+        Number r2, Number *region, Stats &stats) const
     {
-        std::vector<Point *> qr;
+        size_t qr = 0;
 
-        //check for empty branch
-        if (!tree) return qr;
+        ++stats.nodes_visited;
+        stats.distances += tree->stored();
 
-        //leaf node
-        if (point_in_range(tree->pt, range)) {
-            qr.push_back(tree->pt);
+        //points stored at this node
+        for (unsigned int i = 0; i < tree->stored(); ++i) {
+            if (distance(query, tree->pt() + i) <= r2) ++qr;
         }
 
-        //not leaf node
-        if (tree->children) {
-
-            std::vector<Point *> lqr, rqr;
+        //leaf node
+        if (tree->leaf()) return qr;
 
-            Number split_value = tree->median;
+        Number split_value = tree->median;
 
-            //left subtree -- update region
-            int changed_index = 2 * (depth % dim) + 1;
+        //left subtree -- update region
+        int changed_index = 2 * tree->axis + 1;
 
-            Number changed_value = region[changed_index];
-            region[changed_index] = split_value;
+        Number changed_value = region[changed_index];
+        region[changed_index] = split_value;
 
-            if (range_contains_region(range, region)) {
-                if (tree->left()) {
-                    report_subtree(tree->left(), lqr);
-                }
-            } else if (region_intersects_range(region, range)) {
-                lqr = range_search(tree->left(), range, region, depth+1);
+        if (tree->left()) {
+            if (box_distance(query, region) > r2) {
+                ++stats.pruned;
+            } else if (far_distance(query, region) <= r2) {
+                ++stats.contained;
+                qr += tree->left()->count;
+            } else {
+                ++stats.intersected;
+                qr += radius_count(tree->left(), query, r2, region, stats);
             }
+        }
 
-            //restore region
-            region[changed_index] = changed_value;
+        //restore region
+        region[changed_index] = changed_value;
 
-            //right subtree -- update region
-            changed_index = 2 * (depth % dim);
-            changed_value = region[changed_index];
-            region[changed_index] = split_value;
+        //right subtree -- update region
+        changed_index = 2 * tree->axis;
+        changed_value = region[changed_index];
+        region[changed_index] = split_value;
 
-            if (range_contains_region(range, region)) {
-                if (tree->right()) {
-                    report_subtree(tree->right(), rqr);
-                }
-            } else if (region_intersects_range(region, range)) {
-                rqr = range_search(tree->right(), range, region, depth+1);
+        if (tree->right()) {
+            if (box_distance(query, region) > r2) {
+                ++stats.pruned;
+            } else if (far_distance(query, region) <= r2) {
+                ++stats.contained;
+                qr += tree->right()->count;
+            } else {
+                ++stats.intersected;
+                qr += radius_count(tree->right(), query, r2, region, stats);
             }
-
-            //restore region
-            region[changed_index] = changed_value;
-
-            //collect results
-            qr.insert(qr.end(), lqr.begin(), lqr.end());
-            qr.insert(qr.end(), rqr.begin(), rqr.end());
         }
 
+        //restore region
+        region[changed_index] = changed_value;
+
         return qr;
     }
 
-    size_t range_count(Node *tree, Number *range, Number *region, size_t depth)
-    {
-        size_t qr = 0;
+    struct AcceptAll {
+        bool operator()(const Point *) const
+        {
+            return true;
+        }
+    };
 
-        //check for empty branch
-        if (!tree) return qr;
+    //rejects the neighbours a KnnCursor search was seeded with
+    struct SeedFilter {
 
-        //leaf node
-        if (point_in_range(tree->pt, range)) {
-            ++qr;
+        SeedFilter(const std::vector<Point *> &seeds) : seeds(seeds)
+        {
         }
 
-        //not leaf node
-        if (tree->children) {
+        bool operator()(Point *p) const
+        {
+            return !std::binary_search(seeds.begin(), seeds.end(), p);
+        }
 
-            size_t lqr = 0, rqr = 0;
+        const std::vector<Point *> &seeds;
+    };
 
-            Number split_value = tree->median;
+    //stands in for SearchStats in queries which are not being counted, so
+    //that the counting compiles away
+    struct NoStats {
 
-            //left subtree -- update region
-            int changed_index = 2 * (depth % dim) + 1;
+        struct Counter {
+            void operator++() {}
+            void operator+=(size_t) {}
+        };
 
-            Number changed_value = region[changed_index];
-            region[changed_index] = split_value;
+        void queue_length(size_t) {}
 
-            if (range_contains_region(range, region)) {
-                if (tree->left()) {
-                    lqr = report_subtree(tree->left());
-                }
-            } else if (region_intersects_range(region, range)) {
-                lqr = range_count(tree->left(), range, region, depth+1);
-            }
+        Counter nodes_visited, distances, queue_pushes, queue_pops, pruned,
+            contained, intersected;
+    };
 
-            //restore region
-            region[changed_index] = changed_value;
+    template<class Collector> void knn_search(SearchContext &ctx,
+        Collector &resultpq, const Point &query, Number eps) const
+    {
+        AcceptAll all;
+        knn_search(ctx, resultpq, query, eps, all);
+    }
 
-            //right subtree -- update region
-            changed_index = 2 * (depth % dim);
-            changed_value = region[changed_index];
-            region[changed_index] = split_value;
+    template<class Collector, class Filter> void knn_search(SearchContext &ctx,
+        Collector &resultpq, const Point &query, Number eps, Filter &filter) const
+    {
+        const KdTree &tree = local();
+        if (&tree != this) return tree.knn_search(ctx, resultpq, query, eps, filter);
 
-            if (range_contains_region(range, region)) {
-                if (tree->right()) {
-                    rqr = report_subtree(tree->right());
-                }
-            } else if (region_intersects_range(region, range)) {
-                rqr = range_count(tree->right(), range, region, depth+1);
-            }
+        //a collector with no room is always full, and has nothing to peek
+        if (!resultpq.capacity()) return;
 
-            //restore region
-            region[changed_index] = changed_value;
+        KnnTraversal traversal = ctx.traversal == KNN_AUTO
+            ? knn_traversal(resultpq.capacity(), eps) : ctx.traversal;
+        bool depth_first = traversal == KNN_DEPTH_FIRST;
 
-            //collect results
-            qr += lqr + rqr;
+        if (ctx.stats) {
+            knn_search(ctx, resultpq, query, eps, filter, *ctx.stats, depth_first);
+        } else {
+            NoStats none;
+            knn_search(ctx, resultpq, query, eps, filter, none, depth_first);
         }
+    }
 
-        return qr;
+    template<class Collector, class Filter, class Stats> void knn_search(
+        SearchContext &ctx, Collector &resultpq, const Point &query,
+        Number eps, Filter &filter, Stats &stats, bool depth_first) const
+    {
+        if (depth_first) {
+            knn_depth_first(ctx, resultpq, query, eps, filter, stats);
+        } else {
+            knn_best_first(ctx, resultpq, query, eps, filter, stats);
+        }
     }
 
-    void knn_search(FixedSizePriorityQueue<Node *> &resultpq,
-        const Point &pt, Number eps)
+    template<class Collector, class Filter, class Stats> void knn_best_first(
+        SearchContext &ctx, Collector &resultpq, const Point &query,
+        Number eps, Filter &filter, Stats &stats) const
     {
+        PriorityQueue<Node *> &searchpq = ctx.searchpq;
+        const Number *pt = ctx.load_query(query, dim());
+
+        //distances are squared, so the error bound is too
+        double max_error = (1.0 + eps) * (1.0 + eps);
+
+        //cells are searched nearest first by their squared distance from
+        //the query. the queue pops its largest priority, so they are negated.
         searchpq.clear();
-        searchpq.push(0, root);
+        if (root) {
+            searchpq.push(-box_distance(pt, bounds), root);
+            ++stats.queue_pushes;
+            stats.queue_length(searchpq.length);
+        }
 
         while (searchpq.length) {
 
             typename PriorityQueue<Node *>::Entry entry = searchpq.pop();
+            ++stats.queue_pops;
 
             Node *node = entry.data;
+            Number cell_distance = -entry.priority;
 
-            //need to square distance since resultpq distances are squared
-            Number distance = entry.priority*entry.priority;
-
-            if (!resultpq.full() || (1.0 + eps)*distance < resultpq.peek().priority) {
+            //no remaining cell can hold a closer point
+            if (resultpq.full() && cell_distance * max_error >= resultpq.peek().priority) {
+                stats.pruned += searchpq.length + 1;
+                break;
+            }
 
-                while (node) {
+            while (node) {
+                knn_scan(ctx, resultpq, pt, node, filter, stats);
+                if (node->leaf()) break;
 
-                    #ifdef KDTREE_COLLECT_KNN_STATS
-                    ++knn_nodes_visited;
-                    #endif
+                Node *far_child;
+                Number far_distance;
+                node = knn_split(pt, node, cell_distance, far_child, far_distance);
 
-                    //calculate distance from query point to this point
-                    Number distance = 0;
-                    for (int i = 0; i < dim; ++i) {
-                        distance += ((*(node->pt))[i]-pt[i]) * ((*(node->pt))[i]-pt[i]);
+                if (far_child) {
+                    if (!resultpq.full()
+                        || far_distance * max_error < resultpq.peek().priority) {
+                        searchpq.push(-far_distance, far_child);
+                        ++stats.queue_pushes;
+                        stats.queue_length(searchpq.length);
+                    } else {
+                        ++stats.pruned;
                     }
+                }
+            }
+        }
+    }
 
-                    if (!resultpq.full() || distance < resultpq.peek().priority) {
-                        resultpq.push(distance, node);
-                    }
+    template<class Collector, class Filter, class Stats> void knn_depth_first(
+        SearchContext &ctx, Collector &resultpq, const Point &query,
+        Number eps, Filter &filter, Stats &stats) const
+    {
+        if (!root) return;
+
+        const Number *pt = ctx.load_query(query, dim());
+        double max_error = (1.0 + eps) * (1.0 + eps);
+
+        //the far children passed on the way down, deepest on top. each
+        //frame is deeper than the one beneath it, so the stack never holds
+        //more frames than the tree has levels.
+        typename SearchContext::Frame *stack = ctx.stack_buffer(height);
+        stack[0].node = root;
+        stack[0].distance = box_distance(pt, bounds);
+        size_t top = 1;
+        ++stats.queue_pushes;
+        stats.queue_length(top);
+
+        while (top) {
 
-                    if (pt[node->axis] < node->median) {
+            --top;
+            ++stats.queue_pops;
 
-                        if (node->right()) {
-                            Number d = (1.0 + eps)*abs(node->median - pt[node->axis]);
-                            if (d < resultpq.peek().priority) {
-                                searchpq.push(abs(node->median - pt[node->axis]), node->right());
-                            }
-                        }
+            Node *node = stack[top].node;
+            Number cell_distance = stack[top].distance;
 
-                        node = node->left();
+            //the neighbours found since this cell was passed may rule it out
+            if (resultpq.full() && cell_distance * max_error >= resultpq.peek().priority) {
+                ++stats.pruned;
+                continue;
+            }
+
+            while (node) {
+                knn_scan(ctx, resultpq, pt, node, filter, stats);
+                if (node->leaf()) break;
+
+                Node *far_child;
+                Number far_distance;
+                node = knn_split(pt, node, cell_distance, far_child, far_distance);
+
+                if (far_child) {
+                    if (!resultpq.full()
+                        || far_distance * max_error < resultpq.peek().priority) {
+                        stack[top].node = far_child;
+                        stack[top].distance = far_distance;
+                        ++top;
+                        ++stats.queue_pushes;
+                        stats.queue_length(top);
                     } else {
-                        if (node->left()) {
-                            Number d = (1.0 + eps)*abs(node->median - pt[node->axis]);
-                            if (d < resultpq.peek().priority) {
-                                searchpq.push(abs(node->median - pt[node->axis]), node->left());
-                            }
-                        }
-
-                        node = node->right();
+                        ++stats.pruned;
                     }
                 }
             }
         }
     }
+
+    //a KnnCursor searches cold, without re-scoring its candidates, while
+    //fewer than this percentage of the neighbours carry over between
+    //searches
+    static const size_t cursor_min_survival = 75;
+
+    //KNN_AUTO searches depth first for up to this many neighbours, or in
+    //at least this many dimensions
+    static const size_t depth_first_max_k = 16;
+    static const size_t depth_first_min_dim = 8;
+
+    //offers the points held by a node to resultpq
+    template<class Collector, class Filter, class Stats> void knn_scan(
+        SearchContext &ctx, Collector &resultpq, const Number *pt, Node *node,
+        Filter &filter, Stats &stats) const
+    {
+        //for a leaf this is a linear scan over its bucket
+        Point *p = node->pt();
+        unsigned int stored = node->stored();
+
+        ++stats.nodes_visited;
+        stats.distances += stored;
+        if (kernels && stored > 1) {
+            Number *distances = ctx.distance_buffer(stored);
+            kernels->block_distance(pt, coords + (p - pts) * dim(),
+                stored, dim(), distances);
+
+            for (unsigned int i = 0; i < stored; ++i) {
+                if ((!resultpq.full() || distances[i] < resultpq.peek().priority)
+                    && filter(p + i)) {
+                    resultpq.push(distances[i], p + i);
+                }
+            }
+        } else {
+            Point *end = p + stored;
+            for (; p != end; ++p) {
+                Number distance = this->distance(pt, p);
+
+                if ((!resultpq.full() || distance < resultpq.peek().priority)
+                    && filter(p)) {
+                    resultpq.push(distance, p);
+                }
+            }
+        }
+    }
+
+    //returns the child of a branch on the query's side of its split, and
+    //the other child with the distance to its cell
+    Node *knn_split(const Number *pt, Node *node, Number cell_distance,
+        Node *&far_child, Number &far_distance) const
+    {
+        //the far child's cell is as far along the split axis as the
+        //splitting plane, so swap this cell's offset along the axis for the
+        //offset to the plane (Arya and Mount)
+        Number q = pt[node->axis];
+        Number cut = q - node->median;
+        Number offset = q < node->lo ? node->lo - q
+            : q > node->hi ? q - node->hi : 0;
+        far_distance = cell_distance + cut*cut - offset*offset;
+
+        if (cut < 0) {
+            far_child = node->right();
+            return node->left();
+        }
+
+        far_child = node->left();
+        return node->right();
+    }
 };
 
+//save() passes file_chunk to std::min by reference, so it needs storage
+template<class Point, class Number, size_t Dim>
+const size_t KdTree<Point, Number, Dim>::file_chunk;
+
 #endif
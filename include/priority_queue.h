@@ -25,7 +25,19 @@ THE SOFTWARE.
 
 #include <cstdlib>
 
-template<class T> class PriorityQueue {
+#include <algorithm>
+
+/** A max heap with Arity children per node, used as the frontier of best
+    first searches.  Entries are sifted by moving a hole rather than by
+    swapping, and the storage is aligned so that with four 16 byte entries
+    the children of a node share one 64 byte cache line: a pop compares
+    them all for the price of one miss, and the heap is half as deep as a
+    binary one.  Storage grows by doubling and is kept across clear(), so a
+    queue reused for many searches stops allocating once large enough.
+    Entries are held in raw storage, so T must be plain data such as a
+    pointer or an index.
+*/
+template<class T, size_t Arity = 4> class PriorityQueue {
 
 public:
 
@@ -34,66 +46,65 @@ public:
         T data;
     };
 
-    PriorityQueue(int size) : length(0), size(size)
+    PriorityQueue(int size) : length(0), size(0), block(0), entries(0)
+    {
+        reserve(std::max(size, 1));
+    }
+
+    PriorityQueue(const PriorityQueue &other) : length(0), size(0), block(0), entries(0)
     {
-        //need room for dummy entries[0]
-        entries = new Entry[size + 1];
+        *this = other;
     }
 
     virtual ~PriorityQueue()
     {
-        delete[] entries;
+        free(block);
     }
 
     void push(double priority, const T &data)
     {
-        //adjust heap length
-        ++length;
-
-        //resize if necessary
-        if (length == size) {
-
-            size_t new_size = size << 1;
-            Entry *new_entries = new Entry[new_size + 1];
-            for (int i = 1; i < length; ++i) {
-                new_entries[i] = entries[i];
-            }
-
-            delete[] entries;
-            entries = new_entries;
-            size = new_size;
-        }
-
-        //add to end of heap
-        entries[length].priority = priority;
-        entries[length].data = data;
-
-       //place new entry in proper position in heap
-        size_t i = length;
-        size_t parent = i >> 1;
-        while (i != 1 && entries[i].priority > entries[parent].priority) {
-            Entry t = entries[i];
-            entries[i] = entries[parent];
-            entries[parent] = t;
+        if (length == size) reserve(size << 1);
 
-            i = parent;
-            parent = i >> 1;
-        }
+        Entry entry;
+        entry.priority = priority;
+        entry.data = data;
+        sift_up(length++, entry);
     }
 
     Entry pop()
     {
-        Entry min = entries[1];
-        entries[1] = entries[length];
+        Entry max = entries[0];
         --length;
-        heapify(1);
 
-        return min;
+        //sift the last entry down from the root, moving the hole down
+        //through the largest child until the entry fits. the largest child
+        //is selected without branches, as which one it is is unpredictable.
+        const Entry last = entries[length];
+        size_t i = 0;
+        size_t first = 1;
+        while (first < length) {
+            size_t end = std::min(first + Arity, length);
+            size_t largest = first;
+            double priority = entries[first].priority;
+            for (size_t c = first + 1; c < end; ++c) {
+                bool larger = entries[c].priority > priority;
+                largest = larger ? c : largest;
+                priority = larger ? entries[c].priority : priority;
+            }
+
+            if (priority <= last.priority) break;
+            entries[i] = entries[largest];
+            i = largest;
+            first = i * Arity + 1;
+        }
+        entries[i] = last;
+
+        return max;
     }
 
     const Entry &peek()
     {
-        return entries[1];
+        return entries[0];
     }
 
     void clear()
@@ -103,44 +114,52 @@ public:
 
     void operator=(const PriorityQueue &other)
     {
-        if (size < other.size) {
-            delete[] entries;
-            entries = new Entry[other.size];
-        }
+        if (size < other.length) reserve(other.length);
 
-        memcpy(entries, other.entries, (other.length + 1)*sizeof(Entry));
+        std::copy(other.entries, other.entries + other.length, entries);
+        length = other.length;
     }
 
     size_t length;
 
 private:
 
-    Entry *entries;
     size_t size;
 
-    void heapify(size_t i)
-    {
-        size_t l = i << 1;
-        size_t r = l + 1;
-        size_t smallest = i;
+    //the allocation, and the entries within it offset so that the
+    //children of every node start on a cache line
+    void *block;
+    Entry *entries;
 
-        if (l <= length && entries[l].priority > entries[i].priority) {
-            smallest = l;
-        }
+    static const size_t line_size = 64;
 
-        if (r <= length && entries[r].priority > entries[smallest].priority) {
-            smallest = r;
+    //moves parents down into the hole at i until entry fits there
+    void sift_up(size_t i, const Entry &entry)
+    {
+        while (i > 0) {
+            size_t parent = (i - 1) / Arity;
+            if (entries[parent].priority >= entry.priority) break;
+            entries[i] = entries[parent];
+            i = parent;
         }
 
-        if (smallest != i) {
-            Entry t = entries[i];
-            entries[i] = entries[smallest];
-            entries[smallest] = t;
+        entries[i] = entry;
+    }
 
-            heapify(smallest);
-        }
+    void reserve(size_t new_size)
+    {
+        void *new_block;
+        size_t bytes = (new_size + Arity) * sizeof(Entry);
+        if (posix_memalign(&new_block, line_size, bytes)) abort();
+
+        Entry *new_entries = (Entry *)new_block + (Arity - 1);
+        std::copy(entries, entries + length, new_entries);
+
+        free(block);
+        block = new_block;
+        entries = new_entries;
+        size = new_size;
     }
 };
 
 #endif
-
@@ -0,0 +1,345 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <cstdlib>
+
+#include <deque>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+/** A fixed set of worker threads which run fork-join tasks with work stealing.
+
+    Each participating thread has its own deque of tasks.  Tasks spawned by a
+    thread go on the back of its deque and are taken back in LIFO order, idle
+    threads steal from the front of other deques.  The thread which calls
+    run() or parallel_for() participates as thread 0, so a pool of size 1 has
+    no background threads at all and runs everything inline.
+
+    Only one external thread may be inside run() or parallel_for() at a time;
+    concurrent callers are serialized.
+*/
+class ThreadPool {
+
+public:
+
+    /** A unit of work.  Tasks are owned by whoever spawns them and must
+        remain valid until the TaskGroup they were spawned into is waited on.
+    */
+    struct Task {
+        virtual ~Task() {}
+        virtual void run(ThreadPool &pool) = 0;
+    };
+
+    /** Tracks completion of a set of spawned tasks. */
+    struct TaskGroup {
+        TaskGroup() : pending(0) {}
+        long pending;
+    };
+
+    /** Creates a pool.
+
+        \param threads The number of participating threads including the
+                       caller, or 0 to use one per online processor.
+    */
+    ThreadPool(size_t threads = 0) : queued(0), stop(false)
+    {
+        if (threads == 0) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            threads = cpus > 0 ? cpus : 1;
+        }
+
+        pthread_mutex_init(&external_mutex, 0);
+        pthread_mutex_init(&sleep_mutex, 0);
+        pthread_cond_init(&work_cond, 0);
+
+        slots.resize(threads);
+        for (size_t i = 0; i < threads; ++i) {
+            slots[i] = new Slot;
+            slots[i]->pool = this;
+            slots[i]->index = i;
+        }
+
+        for (size_t i = 1; i < threads; ++i) {
+            pthread_create(&slots[i]->thread, 0, worker_main, slots[i]);
+        }
+    }
+
+    virtual ~ThreadPool()
+    {
+        pthread_mutex_lock(&sleep_mutex);
+        stop = true;
+        pthread_cond_broadcast(&work_cond);
+        pthread_mutex_unlock(&sleep_mutex);
+
+        for (size_t i = 1; i < slots.size(); ++i) {
+            pthread_join(slots[i]->thread, 0);
+        }
+
+        for (size_t i = 0; i < slots.size(); ++i) delete slots[i];
+
+        pthread_cond_destroy(&work_cond);
+        pthread_mutex_destroy(&sleep_mutex);
+        pthread_mutex_destroy(&external_mutex);
+    }
+
+    /** Returns the number of participating threads, including the caller. */
+    size_t size() const
+    {
+        return slots.size();
+    }
+
+    /** Returns the index in [0, size()) of the calling thread within this pool.
+        Only meaningful from inside a running task.
+    */
+    size_t thread_index() const
+    {
+        Slot *slot = current();
+        return slot && slot->pool == this ? slot->index : 0;
+    }
+
+    /** Runs a task on the pool and returns once it, and everything it
+        spawned and waited on, has finished.
+    */
+    void run(Task &task)
+    {
+        Slot *saved = current();
+        bool external = !saved || saved->pool != this;
+
+        if (external) {
+            pthread_mutex_lock(&external_mutex);
+            current() = slots[0];
+        }
+
+        task.run(*this);
+
+        if (external) {
+            current() = saved;
+            pthread_mutex_unlock(&external_mutex);
+        }
+    }
+
+    /** Queues a task to be run by this or any other thread.  Must be called
+        from inside a running task.
+    */
+    void spawn(TaskGroup &group, Task &task)
+    {
+        Slot *slot = local_slot();
+
+        __atomic_fetch_add(&group.pending, 1, __ATOMIC_RELAXED);
+
+        Entry e;
+        e.task = &task;
+        e.group = &group;
+
+        pthread_mutex_lock(&slot->mutex);
+        slot->tasks.push_back(e);
+        pthread_mutex_unlock(&slot->mutex);
+
+        __atomic_fetch_add(&queued, 1, __ATOMIC_RELEASE);
+
+        if (slots.size() > 1) {
+            pthread_mutex_lock(&sleep_mutex);
+            pthread_cond_signal(&work_cond);
+            pthread_mutex_unlock(&sleep_mutex);
+        }
+    }
+
+    /** Waits for every task spawned into a group to finish, running queued
+        tasks from this or other threads in the meantime.
+    */
+    void wait(TaskGroup &group)
+    {
+        Slot *slot = local_slot();
+
+        //acquiring the count sees everything the tasks wrote before they
+        //released it
+        while (__atomic_load_n(&group.pending, __ATOMIC_ACQUIRE)) {
+            Entry e;
+            if (take(slot, e)) {
+                execute(e);
+            } else {
+                sched_yield();
+            }
+        }
+    }
+
+    /** Calls body(begin, end, thread) over disjoint subranges covering
+        [begin, end), each no larger than grain, in parallel.  The thread
+        argument is the index of the executing thread, which can be used to
+        select per-thread scratch state.
+    */
+    template<class Body> void parallel_for(size_t begin, size_t end,
+        size_t grain, Body &body)
+    {
+        if (grain == 0) grain = 1;
+
+        RangeTask<Body> task(begin, end, grain, body);
+        run(task);
+    }
+
+private:
+
+    struct Entry {
+        Task *task;
+        TaskGroup *group;
+    };
+
+    struct Slot {
+        Slot() { pthread_mutex_init(&mutex, 0); }
+        ~Slot() { pthread_mutex_destroy(&mutex); }
+
+        ThreadPool *pool;
+        size_t index;
+        pthread_t thread;
+        pthread_mutex_t mutex;
+        std::deque<Entry> tasks;
+    };
+
+    template<class Body> struct RangeTask : public Task {
+
+        RangeTask(size_t begin, size_t end, size_t grain, Body &body)
+            : begin(begin), end(end), grain(grain), body(body)
+        {
+        }
+
+        void run(ThreadPool &pool)
+        {
+            //split off the upper half for others to steal until small enough
+            if (end - begin > grain) {
+                size_t mid = begin + (end - begin) / 2;
+
+                TaskGroup group;
+                RangeTask upper(mid, end, grain, body);
+                pool.spawn(group, upper);
+
+                RangeTask lower(begin, mid, grain, body);
+                lower.run(pool);
+
+                pool.wait(group);
+            } else if (begin < end) {
+                body(begin, end, pool.thread_index());
+            }
+        }
+
+        size_t begin, end, grain;
+        Body &body;
+    };
+
+    std::vector<Slot *> slots;
+
+    long queued;
+    bool stop;
+
+    pthread_mutex_t external_mutex;
+    pthread_mutex_t sleep_mutex;
+    pthread_cond_t work_cond;
+
+    static Slot *&current()
+    {
+        static __thread Slot *slot = 0;
+        return slot;
+    }
+
+    Slot *local_slot()
+    {
+        Slot *slot = current();
+        return slot && slot->pool == this ? slot : slots[0];
+    }
+
+    bool take(Slot *slot, Entry &e)
+    {
+        if (!__atomic_load_n(&queued, __ATOMIC_ACQUIRE)) return false;
+
+        //newest task from our own deque first
+        pthread_mutex_lock(&slot->mutex);
+        if (!slot->tasks.empty()) {
+            e = slot->tasks.back();
+            slot->tasks.pop_back();
+            pthread_mutex_unlock(&slot->mutex);
+            __atomic_fetch_sub(&queued, 1, __ATOMIC_RELEASE);
+            return true;
+        }
+        pthread_mutex_unlock(&slot->mutex);
+
+        //otherwise steal the oldest task from someone else
+        for (size_t i = 1; i < slots.size(); ++i) {
+            Slot *victim = slots[(slot->index + i) % slots.size()];
+
+            pthread_mutex_lock(&victim->mutex);
+            if (!victim->tasks.empty()) {
+                e = victim->tasks.front();
+                victim->tasks.pop_front();
+                pthread_mutex_unlock(&victim->mutex);
+                __atomic_fetch_sub(&queued, 1, __ATOMIC_RELEASE);
+                return true;
+            }
+            pthread_mutex_unlock(&victim->mutex);
+        }
+
+        return false;
+    }
+
+    void execute(Entry &e)
+    {
+        e.task->run(*this);
+        __atomic_fetch_sub(&e.group->pending, 1, __ATOMIC_RELEASE);
+    }
+
+    static void *worker_main(void *arg)
+    {
+        Slot *slot = (Slot *)arg;
+        ThreadPool *pool = slot->pool;
+
+        current() = slot;
+
+        while (1) {
+            Entry e;
+            if (pool->take(slot, e)) {
+                pool->execute(e);
+                continue;
+            }
+
+            pthread_mutex_lock(&pool->sleep_mutex);
+            while (!__atomic_load_n(&pool->queued, __ATOMIC_ACQUIRE)
+                && !pool->stop) {
+                pthread_cond_wait(&pool->work_cond, &pool->sleep_mutex);
+            }
+            bool done = pool->stop;
+            pthread_mutex_unlock(&pool->sleep_mutex);
+
+            if (done) break;
+        }
+
+        return 0;
+    }
+
+    ThreadPool(const ThreadPool &);
+    void operator=(const ThreadPool &);
+};
+
+#endif
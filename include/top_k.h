@@ -0,0 +1,176 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef TOP_K_H_
+#define TOP_K_H_
+
+#include <cstdlib>
+
+/** Collects the k entries of smallest priority pushed to it, for knn
+    searches.  Up to small_k entries are kept in an array sorted by
+    priority, which for the few neighbours most searches want is faster
+    than a heap; more are kept in a binary max heap.  If K is nonzero the
+    capacity is fixed at compile time, the entries are stored inline and
+    the representation is chosen at compile time.  Otherwise the capacity
+    is passed to the constructor.
+
+    Unlike FixedSizePriorityQueue, pushes are not checked for duplicates:
+    a knn search reaches each point of a tree at most once.  Searches
+    seeded with candidates before they start, as by a KnnCursor, skip the
+    seeds as they traverse the tree so that none is pushed twice.
+*/
+template<class T, size_t K = 0> class TopK {
+
+public:
+
+    struct Entry {
+        double priority;
+        T data;
+    };
+
+    //largest capacity kept as a sorted array
+    static const size_t small_k = 32;
+
+    TopK(size_t k = K)
+        : length(0)
+        , size(K ? K : k)
+        , entries(K ? fixed : new Entry[k ? k : 1])
+    {
+    }
+
+    virtual ~TopK()
+    {
+        if (entries != fixed) delete[] entries;
+    }
+
+    /** Adds an entry if there is room or it is nearer than the furthest,
+        which it then replaces.
+    */
+    void push(double priority, const T &data)
+    {
+        if (full()) {
+            if (size == 0 || priority >= peek().priority) return;
+
+            if (!sorted()) {
+                replace_top(priority, data);
+                return;
+            }
+
+            //drop the furthest, which is last
+            --length;
+        }
+
+        if (sorted()) {
+            //shift the further entries up and insert in order
+            size_t i = length++;
+            while (i > 0 && entries[i - 1].priority > priority) {
+                entries[i] = entries[i - 1];
+                --i;
+            }
+            entries[i].priority = priority;
+            entries[i].data = data;
+        } else {
+            //add at the end of the heap and sift up
+            size_t i = length++;
+            while (i > 0 && entries[(i - 1) / 2].priority < priority) {
+                entries[i] = entries[(i - 1) / 2];
+                i = (i - 1) / 2;
+            }
+            entries[i].priority = priority;
+            entries[i].data = data;
+        }
+    }
+
+    /** Removes and returns the entry of largest priority. */
+    Entry pop()
+    {
+        if (sorted()) return entries[--length];
+
+        //move the last entry to the root and sift it down
+        Entry top = entries[0];
+        if (--length) {
+            Entry last = entries[length];
+            replace_top(last.priority, last.data);
+        }
+
+        return top;
+    }
+
+    /** The entry of largest priority. */
+    const Entry &peek() const
+    {
+        return sorted() ? entries[length - 1] : entries[0];
+    }
+
+    bool full() const
+    {
+        return length == size;
+    }
+
+    void clear()
+    {
+        length = 0;
+    }
+
+    /** The most entries kept. */
+    size_t capacity() const
+    {
+        return size;
+    }
+
+    size_t length;
+
+private:
+
+    size_t size;
+    Entry fixed[K ? K : 1];
+    Entry *entries;
+
+    bool sorted() const
+    {
+        return K ? K <= small_k : size <= small_k;
+    }
+
+    //replaces the root of the heap of length entries and sifts it down
+    void replace_top(double priority, const T &data)
+    {
+        size_t i = 0;
+        while (1) {
+            size_t child = 2 * i + 1;
+            if (child >= length) break;
+            if (child + 1 < length && entries[child + 1].priority > entries[child].priority) {
+                ++child;
+            }
+            if (entries[child].priority <= priority) break;
+
+            entries[i] = entries[child];
+            i = child;
+        }
+        entries[i].priority = priority;
+        entries[i].data = data;
+    }
+
+    TopK(const TopK &);
+    void operator=(const TopK &);
+};
+
+#endif
@@ -0,0 +1,473 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <time.h>
+#include <unistd.h>
+
+#include "kdtree.h"
+
+/*  A benchmark over synthetic datasets which prints its results as JSON, so
+    that runs of different versions can be compared.  Every dataset and query
+    set is generated from a fixed seed, so the same arguments always give the
+    same inputs.
+*/
+
+struct Settings {
+    size_t dim;
+    size_t queries;
+    size_t bucket_size;
+    unsigned long long seed;
+    std::vector<std::string> datasets;
+    std::vector<size_t> sizes;
+    const char *dump_dir;
+};
+
+//pseudo-random numbers (splitmix64), so datasets do not depend on the libc
+struct Random {
+
+    Random(unsigned long long seed) : state(seed)
+    {
+    }
+
+    unsigned long long next()
+    {
+        unsigned long long z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    //uniform in [0, 1)
+    double uniform()
+    {
+        return (next() >> 11) * (1.0 / (1ULL << 53));
+    }
+
+    //standard normal, by Box-Muller
+    double gaussian()
+    {
+        double u = 1.0 - uniform();
+        return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * uniform());
+    }
+
+    unsigned long long state;
+};
+
+double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+template<size_t D> struct Point {
+    double v[D];
+
+    double &operator[](size_t i) { return v[i]; }
+    const double &operator[](size_t i) const { return v[i]; }
+};
+
+/** Fills pts with one of the synthetic datasets, all within about [0, 1]^D.
+
+    uniform:    independent uniform coordinates.
+    clustered:  64 gaussian clusters of standard deviation 0.01 about
+                uniformly placed centres.
+    subspace:   a uniform square mapped into D dimensions by a fixed random
+                linear map, plus noise of 1e-4, so the intrinsic dimension is
+                two whatever D is.
+    duplicates: one hundredth as many distinct uniform points, each repeated
+                about a hundred times.
+
+    The stream of a dataset depends only on its name, D and the seed, so a
+    query set drawn with another seed follows the same distribution.
+*/
+template<size_t D> bool generate(const std::string &name, std::vector<Point<D> > &pts,
+    unsigned long long seed, unsigned long long query_seed)
+{
+    //parameters of the distribution are fixed by the dataset seed
+    Random shape(seed);
+    Random rng(query_seed);
+
+    if (name == "uniform") {
+        for (size_t i = 0; i < pts.size(); ++i) {
+            for (size_t d = 0; d < D; ++d) pts[i][d] = rng.uniform();
+        }
+    } else if (name == "clustered") {
+        const size_t clusters = 64;
+        std::vector<Point<D> > centres(clusters);
+        for (size_t c = 0; c < clusters; ++c) {
+            for (size_t d = 0; d < D; ++d) centres[c][d] = shape.uniform();
+        }
+
+        for (size_t i = 0; i < pts.size(); ++i) {
+            const Point<D> &c = centres[rng.next() % clusters];
+            for (size_t d = 0; d < D; ++d) pts[i][d] = c[d] + 0.01 * rng.gaussian();
+        }
+    } else if (name == "subspace") {
+        double map[D][2];
+        for (size_t d = 0; d < D; ++d) {
+            map[d][0] = shape.uniform() / sqrt((double)D);
+            map[d][1] = shape.uniform() / sqrt((double)D);
+        }
+
+        for (size_t i = 0; i < pts.size(); ++i) {
+            double s = rng.uniform(), t = rng.uniform();
+            for (size_t d = 0; d < D; ++d) {
+                pts[i][d] = map[d][0] * s + map[d][1] * t + 1e-4 * rng.gaussian();
+            }
+        }
+    } else if (name == "duplicates") {
+        //the distinct points are drawn from the dataset seed so that queries
+        //land exactly on them too
+        size_t distinct = std::max<size_t>(pts.size() / 100, 1);
+        Random base(shape.next());
+
+        for (size_t i = 0; i < pts.size(); ++i) {
+            Random r(base.state + rng.next() % distinct * 0x9E3779B97F4A7C15ULL);
+            for (size_t d = 0; d < D; ++d) pts[i][d] = r.uniform();
+        }
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+//writes points in the format of tests/data/pts.txt, as read by knn-query
+//and ann-knn-query
+template<size_t D> void dump(const char *dir, const std::string &name, size_t n,
+    const char *kind, const std::vector<Point<D> > &pts)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s-%lu-%lu-%s.txt", dir, name.c_str(),
+        (unsigned long)n, (unsigned long)D, kind);
+
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "error: could not write: %s\n", path);
+        return;
+    }
+
+    fprintf(f, "%lu %lu\n", (unsigned long)pts.size(), (unsigned long)D);
+    for (size_t i = 0; i < pts.size(); ++i) {
+        for (size_t d = 0; d < D; ++d) {
+            fprintf(f, d + 1 < D ? "%.17g, " : "%.17g\n", pts[i][d]);
+        }
+    }
+
+    fclose(f);
+}
+
+//prints throughput and latency percentiles of one measured operation
+void report(std::vector<double> &latencies, double seconds)
+{
+    std::sort(latencies.begin(), latencies.end());
+
+    const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    const char *names[] = {"p50", "p90", "p99", "p999"};
+
+    printf("\"qps\": %.1f, \"latency_ns\": {", latencies.size() / seconds);
+    for (size_t i = 0; i < 4; ++i) {
+        size_t at = std::min(latencies.size() - 1, (size_t)(quantiles[i] * latencies.size()));
+        printf("\"%s\": %.0f, ", names[i], latencies[at] * 1e9);
+    }
+    printf("\"max\": %.0f}", latencies.back() * 1e9);
+}
+
+//prints the mean, median and 99th percentile of each counter of a
+//histogram of search statistics
+template<class Histogram> void report_stats(const Histogram &histogram)
+{
+    printf("\"stats\": {");
+    for (size_t i = 0; i < histogram.total.counters; ++i) {
+        printf("%s\"%s\": {\"mean\": %.2f, \"p50\": %lu, \"p99\": %lu}",
+            i ? ", " : "", histogram.total.counter_name(i), histogram.mean(i),
+            (unsigned long)histogram.quantile(i, 0.5),
+            (unsigned long)histogram.quantile(i, 0.99));
+    }
+    printf("}");
+}
+
+template<class P> struct AcceptAll {
+    bool operator()(P *)
+    {
+        return true;
+    }
+};
+
+template<size_t D> void run(const Settings &settings, const std::string &name,
+    size_t n, bool &first)
+{
+    typedef Point<D> P;
+    typedef KdTree<P, double, D> Tree;
+
+    std::vector<P> pts(n), queries(settings.queries);
+    if (!generate(name, pts, settings.seed, settings.seed + 1)
+        || !generate(name, queries, settings.seed, settings.seed + 2)) {
+        fprintf(stderr, "error: unknown dataset: %s\n", name.c_str());
+        exit(1);
+    }
+
+    if (settings.dump_dir) {
+        dump(settings.dump_dir, name, n, "points", pts);
+        dump(settings.dump_dir, name, n, "queries", queries);
+    }
+
+    fprintf(stderr, "%s: %lu points in %lu dimensions\n", name.c_str(),
+        (unsigned long)n, (unsigned long)D);
+
+    printf("%s\n    {\"dataset\": \"%s\", \"n\": %lu, \"dim\": %lu, \"queries\": %lu,\n",
+        first ? "" : ",", name.c_str(), (unsigned long)n, (unsigned long)D,
+        (unsigned long)queries.size());
+    first = false;
+
+    typename Tree::Options options;
+    options.bucket_size = settings.bucket_size;
+
+    double start = now();
+    Tree tree(D, &pts[0], n, options);
+    printf("     \"build\": {\"seconds\": %.6f},\n", now() - start);
+
+    std::vector<double> latencies(queries.size());
+    typename Tree::SearchContext ctx(n);
+
+    printf("     \"knn\": [");
+    const size_t ks[] = {1, 10, 100};
+    const double epss[] = {0.0, 0.5, 2.0};
+    for (size_t i = 0; i < 3; ++i) {
+        for (size_t j = 0; j < 3; ++j) {
+            TopK<P *> pq(ks[i]);
+            AcceptAll<P> filter;
+            double found = 0;
+
+            double begin = now();
+            for (size_t q = 0; q < queries.size(); ++q) {
+                double t = now();
+                tree.knn_accumulate(ctx, pq, queries[q], epss[j], filter);
+                latencies[q] = now() - t;
+
+                found += pq.length;
+                pq.clear();
+            }
+            double seconds = now() - begin;
+
+            //count the work separately so it does not distort the timing
+            typename Tree::SearchStats stats;
+            typename Tree::SearchHistogram histogram;
+            ctx.stats = &stats;
+            for (size_t q = 0; q < queries.size(); ++q) {
+                tree.knn_accumulate(ctx, pq, queries[q], epss[j], filter);
+                pq.clear();
+
+                histogram.add(stats);
+                stats.clear();
+            }
+            ctx.stats = 0;
+
+            //the same queries with each traversal forced, to show which
+            //wins and whether the automatic choice picked it
+            double traversal_qps[2];
+            for (int depth_first = 0; depth_first < 2; ++depth_first) {
+                ctx.traversal = depth_first ? Tree::KNN_DEPTH_FIRST : Tree::KNN_BEST_FIRST;
+
+                double begin = now();
+                for (size_t q = 0; q < queries.size(); ++q) {
+                    tree.knn_accumulate(ctx, pq, queries[q], epss[j], filter);
+                    pq.clear();
+                }
+                traversal_qps[depth_first] = queries.size() / (now() - begin);
+            }
+            ctx.traversal = Tree::KNN_AUTO;
+
+            printf("%s\n       {\"k\": %lu, \"eps\": %g, \"mean_found\": %.3f, ",
+                i + j ? "," : "", (unsigned long)ks[i], epss[j],
+                found / queries.size());
+            report(latencies, seconds);
+            printf(",\n        ");
+            report_stats(histogram);
+            printf(",\n        \"traversal\": {\"best_first_qps\": %.1f, "
+                "\"depth_first_qps\": %.1f, \"winner\": \"%s\", \"auto\": \"%s\"}}",
+                traversal_qps[0], traversal_qps[1],
+                traversal_qps[1] > traversal_qps[0] ? "depth_first" : "best_first",
+                tree.knn_traversal(ks[i], epss[j]) == Tree::KNN_DEPTH_FIRST
+                    ? "depth_first" : "best_first");
+        }
+    }
+    printf("\n     ],\n");
+
+    //boxes sized to hold about 16 points of the uniform dataset
+    double side = pow(16.0 / n, 1.0 / D);
+    std::vector<double> range(2 * D);
+    std::vector<P *> results;
+
+    for (int counting = 0; counting < 2; ++counting) {
+        double found = 0, seconds = 0;
+        typename Tree::SearchStats stats;
+        typename Tree::SearchHistogram histogram;
+
+        //the second pass counts the work done by the queries the first timed
+        for (int pass = 0; pass < 2; ++pass) {
+            typename Tree::SearchStats *counted = pass ? &stats : 0;
+
+            double begin = now();
+            for (size_t q = 0; q < queries.size(); ++q) {
+                for (size_t d = 0; d < D; ++d) {
+                    range[d * 2] = queries[q][d] - side / 2;
+                    range[d * 2 + 1] = queries[q][d] + side / 2;
+                }
+
+                double t = now();
+                if (counting) {
+                    found += tree.range_count(&range[0], counted);
+                } else {
+                    results.clear();
+                    tree.range_search(&range[0], results, counted);
+                    found += results.size();
+                }
+                if (pass) {
+                    histogram.add(stats);
+                    stats.clear();
+                } else {
+                    latencies[q] = now() - t;
+                }
+            }
+
+            if (!pass) seconds = now() - begin;
+        }
+
+        printf("     \"%s\": {\"side\": %g, \"mean_found\": %.3f, ",
+            counting ? "range_count" : "range", side, found / (2 * queries.size()));
+        report(latencies, seconds);
+        printf(",\n      ");
+        report_stats(histogram);
+        printf("}%s\n", counting ? "" : ",");
+    }
+
+    printf("    }");
+    fflush(stdout);
+}
+
+void run(const Settings &settings, const std::string &name, size_t n, bool &first)
+{
+    switch (settings.dim) {
+    case 2: run<2>(settings, name, n, first); break;
+    case 3: run<3>(settings, name, n, first); break;
+    case 4: run<4>(settings, name, n, first); break;
+    case 8: run<8>(settings, name, n, first); break;
+    case 16: run<16>(settings, name, n, first); break;
+    default:
+        fprintf(stderr, "error: unsupported dimension: %lu\n", (unsigned long)settings.dim);
+        exit(1);
+    }
+}
+
+void usage()
+{
+    printf("usage: bench [-d dim] [-q queries] [-b bucket size] [-s seed]\n"
+           "             [-g dataset] [-o dump dir] [points ...]\n"
+           "datasets are uniform, clustered, subspace and duplicates, all by\n"
+           "default. dim is 2, 3, 4, 8 or 16. -o also writes every dataset and\n"
+           "query set to the dump dir in the format read by knn-query and\n"
+           "ann-knn-query. results are printed as JSON.\n");
+    exit(1);
+}
+
+//splits a comma separated list
+std::vector<std::string> split_list(const char *s)
+{
+    std::vector<std::string> items;
+    const char *start = s;
+    for (const char *p = s; ; ++p) {
+        if (*p == ',' || *p == 0) {
+            if (p > start) items.push_back(std::string(start, p));
+            if (*p == 0) break;
+            start = p + 1;
+        }
+    }
+    return items;
+}
+
+int main(int argc, char **argv)
+{
+    Settings settings;
+    settings.dim = 3;
+    settings.queries = 10000;
+    settings.bucket_size = 1;
+    settings.seed = 1;
+    settings.dump_dir = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "d:q:b:s:g:o:h")) != -1) {
+        switch (c) {
+        case 'd': settings.dim = strtoul(optarg, 0, 10); break;
+        case 'q': settings.queries = strtoul(optarg, 0, 10); break;
+        case 'b': settings.bucket_size = strtoul(optarg, 0, 10); break;
+        case 's': settings.seed = strtoull(optarg, 0, 10); break;
+        case 'g': settings.datasets = split_list(optarg); break;
+        case 'o': settings.dump_dir = optarg; break;
+        default: usage();
+        }
+    }
+
+    for (int i = optind; i < argc; ++i) {
+        size_t n = strtoul(argv[i], 0, 10);
+        if (n == 0) usage();
+        settings.sizes.push_back(n);
+    }
+
+    if (settings.datasets.empty()) {
+        settings.datasets.push_back("uniform");
+        settings.datasets.push_back("clustered");
+        settings.datasets.push_back("subspace");
+        settings.datasets.push_back("duplicates");
+    }
+
+    if (settings.sizes.empty()) {
+        settings.sizes.push_back(10000);
+        settings.sizes.push_back(1000000);
+    }
+
+    if (settings.queries == 0) usage();
+
+    printf("{\"dim\": %lu, \"bucket_size\": %lu, \"seed\": %llu, \"results\": [",
+        (unsigned long)settings.dim, (unsigned long)settings.bucket_size, settings.seed);
+
+    bool first = true;
+    for (size_t i = 0; i < settings.sizes.size(); ++i) {
+        for (size_t j = 0; j < settings.datasets.size(); ++j) {
+            run(settings, settings.datasets[j], settings.sizes[i], first);
+        }
+    }
+
+    printf("\n]}\n");
+
+    return 0;
+}
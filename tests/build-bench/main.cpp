@@ -0,0 +1,214 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <vector>
+
+#include <sys/time.h>
+
+#include "kdtree.h"
+
+const size_t DIM = 3;
+
+struct Point {
+    double v[DIM];
+
+    double &operator[](size_t i) { return v[i]; }
+    const double &operator[](size_t i) const { return v[i]; }
+};
+
+double elapsed(const timeval &start)
+{
+    timeval now;
+    gettimeofday(&now, 0);
+    return (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) * 1e-6;
+}
+
+//fills pts from a fixed seed so every build sees the same input without
+//keeping a second copy of it around
+void generate(std::vector<Point> &pts)
+{
+    unsigned long long state = 12345;
+    for (size_t i = 0; i < pts.size(); ++i) {
+        for (size_t j = 0; j < DIM; ++j) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            pts[i][j] = (double)(state >> 11) / (double)(1ULL << 53);
+        }
+    }
+}
+
+//hash of the order the build left the points in, which fixes the tree shape
+unsigned long long fingerprint(const std::vector<Point> &pts)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    const unsigned char *p = (const unsigned char *)&pts[0];
+    for (size_t i = 0; i < pts.size() * sizeof(Point); ++i) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+//the previous median build: rand() pivots with a lexicographic tie-break
+namespace previous {
+
+int pt_lt(size_t coord, const Point &a, const Point &b)
+{
+    if (a[coord] != b[coord]) {
+        return a[coord] < b[coord];
+    } else {
+        size_t i = (coord + 1) % DIM;
+        while (a[i] == b[i] && i != coord) i = (i + 1) % DIM;
+        return a[i] <= b[i];
+    }
+}
+
+size_t partition(size_t start, size_t end, Point *pts, size_t coord)
+{
+    size_t pivot = start + rand() % (end - start);
+    std::swap(pts[pivot], pts[end]);
+
+    size_t i = start;
+    for (size_t j = start; j < end; ++j) {
+        if (pt_lt(coord, pts[j], pts[end])) {
+            std::swap(pts[i], pts[j]);
+            ++i;
+        }
+    }
+
+    std::swap(pts[i], pts[end]);
+
+    return i;
+}
+
+double select_order(size_t i, Point *pts, size_t pt_count, size_t coord)
+{
+    size_t start = 0;
+    size_t end = pt_count - 1;
+
+    while (1) {
+
+        if (start == end) return pts[start][coord];
+
+        size_t pivot = partition(start, end, pts, coord);
+
+        if (i == pivot) {
+            return pts[pivot][coord];
+        } else if (i < pivot) {
+            end = pivot - 1;
+        } else {
+            start = pivot + 1;
+        }
+    }
+}
+
+void build(Point *pts, size_t pt_count, size_t depth)
+{
+    if (pt_count <= 1) return;
+
+    size_t median_index = (pt_count / 2) >> 1 << 1;
+    select_order(median_index, pts, pt_count, depth % DIM);
+
+    build(pts, median_index, depth + 1);
+    build(pts + median_index + 1, pt_count - median_index - 1, depth + 1);
+}
+
+}
+
+void run(size_t n)
+{
+    std::vector<Point> pts(n);
+    timeval start;
+
+    generate(pts);
+    gettimeofday(&start, 0);
+    previous::build(&pts[0], n, 0);
+    double old_time = elapsed(start);
+
+    //the previous build only partitions points, it writes no nodes, so this
+    //comparison flatters it slightly
+    generate(pts);
+    gettimeofday(&start, 0);
+    KdTree<Point, double, DIM> *tree =
+        new KdTree<Point, double, DIM>(DIM, &pts[0], n);
+    double new_time = elapsed(start);
+    delete tree;
+    unsigned long long first = fingerprint(pts);
+
+    generate(pts);
+    tree = new KdTree<Point, double, DIM>(DIM, &pts[0], n);
+    delete tree;
+    unsigned long long second = fingerprint(pts);
+
+    //a parallel build must give the same tree as a serial one
+    ThreadPool pool;
+    KdTree<Point, double, DIM>::Options options;
+    options.pool = &pool;
+
+    generate(pts);
+    gettimeofday(&start, 0);
+    tree = new KdTree<Point, double, DIM>(DIM, &pts[0], n, options);
+    double parallel_time = elapsed(start);
+    delete tree;
+    unsigned long long parallel = fingerprint(pts);
+
+    //and so must one on huge pages first touched by the pool
+    options.huge_pages = true;
+    options.first_touch = true;
+
+    generate(pts);
+    gettimeofday(&start, 0);
+    tree = new KdTree<Point, double, DIM>(DIM, &pts[0], n, options);
+    double huge_time = elapsed(start);
+    delete tree;
+    unsigned long long huge = fingerprint(pts);
+
+    printf("%10lu points: previous %.3fs, introselect %.3fs (%.2fx), "
+        "parallel %.3fs on %lu threads, huge pages %.3fs, %s\n",
+        (unsigned long)n, old_time, new_time, old_time / new_time,
+        parallel_time, (unsigned long)pool.size(), huge_time,
+        first == second && first == parallel && first == huge
+            ? "reproducible" : "NOT reproducible");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 1) {
+        printf("usage: build-bench <points> [points ...]\n");
+        printf("benchmarking the default sizes 1M, 10M and 100M\n");
+    }
+
+    std::vector<size_t> sizes;
+    for (int i = 1; i < argc; ++i) sizes.push_back(strtoul(argv[i], 0, 10));
+
+    if (sizes.empty()) {
+        sizes.push_back(1000000);
+        sizes.push_back(10000000);
+        sizes.push_back(100000000);
+    }
+
+    for (size_t i = 0; i < sizes.size(); ++i) run(sizes[i]);
+
+    return 0;
+}
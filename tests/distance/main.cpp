@@ -0,0 +1,141 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include <vector>
+
+#include <sys/time.h>
+
+#include "distance.h"
+
+const size_t BLOCK_SIZE = 32;
+const size_t BLOCK_COUNT = 4096;
+const int REPEATS = 20;
+
+const char *isa_names[] = {"scalar", "sse2", "avx2", "avx512"};
+
+double elapsed(const timeval &start)
+{
+    timeval now;
+    gettimeofday(&now, 0);
+    return (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) * 1e-6;
+}
+
+//checks each supported kernel against the scalar one and times it
+template<class Number> int run(const char *name, size_t dim)
+{
+    typedef DistanceKernels<Number> Kernels;
+
+    std::vector<Number> block(dim * BLOCK_SIZE * BLOCK_COUNT);
+    std::vector<Number> query(dim), out(BLOCK_SIZE), range(2 * dim);
+
+    for (size_t i = 0; i < block.size(); ++i) {
+        block[i] = (Number)rand() / (Number)RAND_MAX;
+    }
+
+    for (size_t i = 0; i < dim; ++i) {
+        query[i] = (Number)rand() / (Number)RAND_MAX;
+        range[i * 2] = 0.01;
+        range[i * 2 + 1] = 0.99;
+    }
+
+    int errors = 0;
+    Number scalar_sum = 0;
+    size_t scalar_inside = 0;
+
+    printf("%s dim=%3lu", name, (unsigned long)dim);
+
+    for (int isa = 0; isa <= Kernels::supported(); ++isa) {
+        Kernels k = Kernels::select((typename Kernels::Isa)isa);
+
+        timeval start;
+        gettimeofday(&start, 0);
+
+        Number sum = 0;
+        for (int r = 0; r < REPEATS; ++r) {
+            for (size_t b = 0; b < BLOCK_COUNT; ++b) {
+                k.block_distance(&query[0], &block[b * dim * BLOCK_SIZE],
+                    BLOCK_SIZE, dim, &out[0]);
+                for (size_t j = 0; j < BLOCK_SIZE; ++j) sum += out[j];
+            }
+        }
+
+        size_t inside = 0;
+        for (size_t j = 0; j < BLOCK_SIZE * BLOCK_COUNT; ++j) {
+            inside += k.in_range(&block[j * dim], &range[0], dim);
+        }
+
+        double t = elapsed(start);
+
+        Number single = k.distance(&query[0], &block[0], dim);
+        Number expected = Kernels::scalar_distance(&query[0], &block[0], dim);
+
+        if (isa == 0) {
+            scalar_sum = sum;
+            scalar_inside = inside;
+        }
+
+        bool ok = fabs(sum - scalar_sum) <= 1e-4 * fabs(scalar_sum)
+            && fabs(single - expected) <= 1e-4 * fabs(expected)
+            && inside == scalar_inside;
+
+        //across points, in few dimensions, the block kernels sum as the
+        //scalar kernel does, including for a block that is not a whole
+        //number of vectors
+        if (dim <= Kernels::cross_max_dim) {
+            size_t count = BLOCK_SIZE - 3;
+            k.block_distance(&query[0], &block[0], count, dim, &out[0]);
+            for (size_t j = 0; j < count; ++j) {
+                ok = ok && out[j] == Kernels::scalar_distance(&query[0],
+                    &block[j * dim], dim);
+            }
+        }
+
+        printf("  %s %.3fs%s", isa_names[k.isa], t, ok ? "" : " (mismatch)");
+        if (!ok) ++errors;
+    }
+
+    printf("  best %s\n", isa_names[Kernels::best(dim).isa]);
+
+    return errors;
+}
+
+int main(int argc, char **argv)
+{
+    size_t dims[] = {1, 2, 3, 4, 7, 8, 16, 17, 33, 64, 128};
+
+    int errors = 0;
+    for (size_t i = 0; i < sizeof(dims) / sizeof(dims[0]); ++i) {
+        errors += run<double>("double", dims[i]);
+        errors += run<float>("float", dims[i]);
+    }
+
+    if (errors) {
+        printf("error: %d kernels disagree with the scalar kernel\n", errors);
+        return -1;
+    }
+
+    return 0;
+}
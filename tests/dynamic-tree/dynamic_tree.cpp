@@ -0,0 +1,221 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <vector>
+
+#include <sys/time.h>
+
+#include "dynamic_kdtree.h"
+
+const size_t DIM = 3;
+const size_t K = 5;
+
+typedef double Point[DIM];
+typedef DynamicKdTree<Point, double> Dynamic;
+typedef KdTree<Point, double> Static;
+
+double elapsed(const timeval &start)
+{
+    timeval now;
+    gettimeofday(&now, 0);
+    return (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) * 1e-6;
+}
+
+void random_point(Point &pt)
+{
+    for (size_t d = 0; d < DIM; ++d) pt[d] = rand() % 100000 / 10.0;
+}
+
+double distance(const Point &a, const Point &b)
+{
+    double distance = 0;
+    for (size_t d = 0; d < DIM; ++d) distance += (a[d] - b[d]) * (a[d] - b[d]);
+    return distance;
+}
+
+//compares knn and range queries against a linear scan of the live points
+int check(const Dynamic &tree, const std::vector<Point *> &pts,
+    const std::vector<bool> &live, const Point &query)
+{
+    std::vector<double> distances;
+    size_t count = 0;
+    size_t radius_count = 0;
+
+    double range[2 * DIM];
+    for (size_t d = 0; d < DIM; ++d) {
+        range[d * 2] = query[d] - 500;
+        range[d * 2 + 1] = query[d] + 500;
+    }
+
+    for (size_t i = 0; i < pts.size(); ++i) {
+        if (!live[i]) continue;
+
+        distances.push_back(distance(*pts[i], query));
+
+        bool in = true;
+        for (size_t d = 0; d < DIM; ++d) {
+            if ((*pts[i])[d] < range[d * 2] || (*pts[i])[d] > range[d * 2 + 1]) in = false;
+        }
+        if (in) ++count;
+        if (distances.back() <= 500 * 500) ++radius_count;
+    }
+
+    std::sort(distances.begin(), distances.end());
+
+    std::list<std::pair<size_t, double> > qr = tree.knn(K, query, 0.0);
+
+    if (qr.size() != std::min(K, distances.size())) {
+        printf("error: knn found %d points, expected %d\n", (int)qr.size(),
+            (int)std::min(K, distances.size()));
+        return 1;
+    }
+
+    size_t i = 0;
+    for (std::list<std::pair<size_t, double> >::iterator itor = qr.begin(); itor != qr.end(); ++itor, ++i) {
+        if (!live[itor->first] || itor->second != distances[i]
+            || distance(*pts[itor->first], query) != itor->second) {
+            printf("error: knn result %d is wrong\n", (int)i + 1);
+            return 1;
+        }
+    }
+
+    if (tree.range_count(range) != count || tree.range_search(range).size() != count) {
+        printf("error: range query found %d points, expected %d\n",
+            (int)tree.range_count(range), (int)count);
+        return 1;
+    }
+
+    if (tree.radius_count(query, 500) != radius_count
+        || tree.radius_search(query, 500).size() != radius_count) {
+        printf("error: radius query found %d points, expected %d\n",
+            (int)tree.radius_count(query, 500), (int)radius_count);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && atoi(argv[1]) <= 0) {
+        printf("usage: dynamic_tree [operations] [points]\n");
+        exit(1);
+    }
+
+    //operations checked against a linear scan, then points timed
+    int ops = argc > 1 ? atoi(argv[1]) : 20000;
+    int pt_count = argc > 2 ? atoi(argv[2]) : 1000000;
+
+    Dynamic tree(DIM);
+    std::vector<Point *> pts;
+    std::vector<bool> live;
+    std::vector<size_t> ids;
+
+    for (int i = 0; i < ops; ++i) {
+        int op = rand() % 10;
+
+        if (op < 6 || ids.empty()) {
+            Point *pt = new Point[1];
+            random_point(*pt);
+
+            size_t id = tree.insert(*pt);
+            if (id < pts.size()) {
+                delete[] pts[id];
+            } else {
+                pts.resize(id + 1);
+                live.resize(id + 1);
+            }
+            pts[id] = pt;
+            live[id] = true;
+            ids.push_back(id);
+        } else if (op < 9) {
+            size_t j = rand() % ids.size();
+            size_t id = ids[j];
+            ids[j] = ids.back();
+            ids.pop_back();
+
+            if (!tree.erase(id) || tree.erase(id)) {
+                printf("error: erase of %d failed\n", (int)id);
+                return -1;
+            }
+            live[id] = false;
+        } else {
+            Point query;
+            random_point(query);
+            if (check(tree, pts, live, query)) return -1;
+        }
+
+        if (tree.size() != ids.size()) {
+            printf("error: size is %d, expected %d\n", (int)tree.size(), (int)ids.size());
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < pts.size(); ++i) delete[] pts[i];
+
+    //timings against a static tree of the same points
+    Point *static_pts = new Point[pt_count];
+    Point *queries = new Point[10000];
+    for (int i = 0; i < pt_count; ++i) random_point(static_pts[i]);
+    for (int i = 0; i < 10000; ++i) random_point(queries[i]);
+
+    Dynamic timed(DIM);
+    timeval start;
+
+    gettimeofday(&start, 0);
+    for (int i = 0; i < pt_count; ++i) timed.insert(static_pts[i]);
+    double insert_time = elapsed(start);
+
+    gettimeofday(&start, 0);
+    Static static_tree(DIM, static_pts, pt_count);
+    double build_time = elapsed(start);
+
+    gettimeofday(&start, 0);
+    for (int i = 0; i < 10000; ++i) timed.knn(K, queries[i], 0.0);
+    double dynamic_knn = elapsed(start);
+
+    gettimeofday(&start, 0);
+    for (int i = 0; i < 10000; ++i) static_tree.knn(K, queries[i], 0.0);
+    double static_knn = elapsed(start);
+
+    gettimeofday(&start, 0);
+    for (int i = 0; i < pt_count; i += 2) timed.erase(i);
+    double erase_time = elapsed(start);
+
+    fprintf(stderr, "%d points: insert %.2f us each (static build %.2f us per point), "
+        "erase %.2f us each\n", pt_count, insert_time / pt_count * 1e6,
+        build_time / pt_count * 1e6, erase_time / (pt_count / 2) * 1e6);
+    fprintf(stderr, "knn: dynamic %.0f queries/s, static %.0f queries/s\n",
+        10000 / dynamic_knn, 10000 / static_knn);
+
+    delete[] static_pts;
+    delete[] queries;
+
+    printf("done.\n");
+
+    return 0;
+}
@@ -0,0 +1,262 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include <sys/time.h>
+
+#include <list>
+#include <vector>
+
+#include "kdtree.h"
+
+const size_t DIM = 3;
+
+//the most a cursor may take over cold searches of the same queries
+const double MAX_SLOWDOWN = 1.2;
+
+typedef double Point[DIM];
+typedef KdTree<Point, double> Tree;
+
+struct AcceptAll {
+    bool operator()(Point *)
+    {
+        return true;
+    }
+};
+
+double elapsed(const timeval &start)
+{
+    timeval now;
+    gettimeofday(&now, 0);
+    return (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) * 1e-6;
+}
+
+double uniform()
+{
+    return (double)rand() / RAND_MAX;
+}
+
+//a smoothly turning path with steps of length step, which bounces off the
+//sides of the unit cube and now and then jumps somewhere else entirely
+std::vector<double> trajectory(size_t steps, double step)
+{
+    std::vector<double> walk(steps * DIM);
+    double heading[DIM];
+    for (size_t d = 0; d < DIM; ++d) {
+        walk[d] = uniform();
+        heading[d] = 0;
+    }
+    heading[0] = 1;
+
+    for (size_t i = 1; i < steps; ++i) {
+        bool jump = rand() % 1000 == 0;
+
+        double length = 0;
+        for (size_t d = 0; d < DIM; ++d) {
+            heading[d] += (uniform() - 0.5) * 0.2;
+            length += heading[d] * heading[d];
+        }
+
+        for (size_t d = 0; d < DIM; ++d) {
+            heading[d] /= sqrt(length);
+
+            double &c = walk[i * DIM + d];
+            c = jump ? uniform() : walk[(i - 1) * DIM + d] + heading[d] * step;
+            if (c < 0 || c > 1) {
+                heading[d] = -heading[d];
+                c = walk[(i - 1) * DIM + d];
+            }
+        }
+    }
+
+    return walk;
+}
+
+//checks a cursor following a trajectory finds neighbours at the same
+//distances as cold searches
+int check(Tree &tree, size_t k, const std::vector<double> &walk,
+    Tree::KnnTraversal traversal)
+{
+    Tree::KnnCursor cursor(k);
+    Tree::SearchContext ctx;
+    cursor.ctx.traversal = ctx.traversal = traversal;
+
+    for (size_t i = 0; i < walk.size() / DIM; ++i) {
+        const Point &query = *(const Point *)&walk[i * DIM];
+
+        tree.knn(cursor, query, 0.0);
+        std::list<std::pair<Point *, double> > qr = tree.knn(ctx, k, query, 0.0);
+
+        bool same = qr.size() == cursor.results.size();
+        std::list<std::pair<Point *, double> >::iterator itor = qr.begin();
+        for (size_t j = 0; same && j < cursor.results.size(); ++j, ++itor) {
+            same = itor->second == cursor.results[j].second;
+        }
+
+        if (!same) {
+            printf("error: cursor found %d neighbours for k = %d at step %d, "
+                "expected %d\n", (int)cursor.results.size(), (int)k, (int)i,
+                (int)qr.size());
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+//times cold searches along a trajectory
+double cold_pass(Tree &tree, size_t k, const std::vector<double> &walk,
+    Tree::SearchStats &stats)
+{
+    Tree::SearchContext ctx;
+    ctx.stats = &stats;
+    TopK<Point *> pq(k);
+    AcceptAll all;
+
+    //the cold searches sort their neighbours as the cursor does
+    std::vector<std::pair<Point *, double> > results;
+
+    timeval start;
+    gettimeofday(&start, 0);
+    for (size_t i = 0; i < walk.size() / DIM; ++i) {
+        pq.clear();
+        tree.knn_accumulate(ctx, pq, *(const Point *)&walk[i * DIM], 0.0, all);
+
+        results.resize(pq.length);
+        for (size_t j = results.size(); j-- > 0; ) {
+            TopK<Point *>::Entry e = pq.pop();
+            results[j] = std::make_pair(e.data, e.priority);
+        }
+    }
+
+    return elapsed(start);
+}
+
+//times a cursor along a trajectory
+double cursor_pass(Tree &tree, size_t k, const std::vector<double> &walk,
+    Tree::SearchStats &stats)
+{
+    Tree::KnnCursor cursor(k);
+    cursor.ctx.stats = &stats;
+
+    timeval start;
+    gettimeofday(&start, 0);
+    for (size_t i = 0; i < walk.size() / DIM; ++i) {
+        tree.knn(cursor, *(const Point *)&walk[i * DIM], 0.0);
+    }
+
+    return elapsed(start);
+}
+
+//times cold searches and a cursor along the same trajectory, taking the
+//best of a few alternating runs of each, and checks the cursor is never
+//much slower
+int bench(Tree &tree, size_t k, const std::vector<double> &walk, double step)
+{
+    size_t steps = walk.size() / DIM;
+
+    double cold = 0, warm = 0;
+    Tree::SearchStats cold_stats, warm_stats;
+    for (int run = 0; run < 3; ++run) {
+        cold_stats.clear();
+        warm_stats.clear();
+
+        double c = cold_pass(tree, k, walk, cold_stats);
+        double w = cursor_pass(tree, k, walk, warm_stats);
+        if (!run || c < cold) cold = c;
+        if (!run || w < warm) warm = w;
+    }
+
+    printf("  k=%-3d step %-6g cold %9.0f queries/s, %6.1f nodes/query; "
+        "cursor %9.0f queries/s, %6.1f nodes/query (%.1fx)\n", (int)k, step,
+        steps / cold, (double)cold_stats.nodes_visited / steps,
+        steps / warm, (double)warm_stats.nodes_visited / steps, cold / warm);
+
+    if (warm > cold * MAX_SLOWDOWN) {
+        printf("error: the cursor is %.2fx slower than cold searches\n", warm / cold);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int errors = 0;
+
+    //small trees of each shape, walked with steps from much smaller than
+    //the spacing of the points to much larger
+    int pt_count = 2000;
+    Point *pts = new Point[pt_count];
+    for (int i = 0; i < pt_count; ++i) {
+        for (size_t d = 0; d < DIM; ++d) pts[i][d] = uniform();
+    }
+
+    const size_t ks[] = {1, 5, 40};
+    const double steps[] = {0.001, 0.02, 0.2};
+    const Tree::SplitRule splits[] = {Tree::SPLIT_CYCLE, Tree::SPLIT_SLIDING_MIDPOINT};
+    for (size_t b = 0; b < 4 && !errors; ++b) {
+        Tree::Options options;
+        options.bucket_size = b % 2 ? 8 : 1;
+        options.split = splits[b / 2];
+        Tree tree(DIM, pts, pt_count, options);
+
+        for (size_t i = 0; i < 9 && !errors; ++i) {
+            std::vector<double> walk = trajectory(3000, steps[i % 3]);
+            errors += check(tree, ks[i / 3], walk, Tree::KNN_DEPTH_FIRST);
+            errors += check(tree, ks[i / 3], walk, Tree::KNN_BEST_FIRST);
+        }
+    }
+
+    delete[] pts;
+
+    if (errors) return -1;
+
+    //throughput on a larger tree, with steps from a hundredth of the
+    //spacing of the points to ten times it
+    pt_count = argc > 1 ? atoi(argv[1]) : 1000000;
+    pts = new Point[pt_count];
+    for (int i = 0; i < pt_count; ++i) {
+        for (size_t d = 0; d < DIM; ++d) pts[i][d] = uniform();
+    }
+
+    Tree::Options options;
+    options.bucket_size = 8;
+    Tree tree(DIM, pts, pt_count, options);
+
+    double spacing = pow(1.0 / pt_count, 1.0 / DIM);
+    printf("trajectories over %d uniform points in %d dimensions\n",
+        pt_count, (int)DIM);
+    for (size_t i = 0; i < 3; ++i) {
+        double step = spacing / 100;
+        for (int s = 0; s < 4; ++s, step *= 10) {
+            errors += bench(tree, ks[i] == 5 ? 10 : ks[i], trajectory(100000, step), step);
+        }
+    }
+
+    delete[] pts;
+
+    return errors ? -1 : 0;
+}
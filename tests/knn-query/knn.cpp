@@ -27,6 +27,8 @@ THE SOFTWARE.
 #include <fstream>
 #include <iostream>
 
+#include <sys/time.h>
+
 #include "kdtree.h"
 
 struct Point {
@@ -118,10 +120,37 @@ Point *read_points(const char *filename, int &count, int &dim)
     return pts; 
 }
 
+double elapsed(const timeval &start)
+{
+    timeval now;
+    gettimeofday(&now, 0);
+    return (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) * 1e-6;
+}
+
+void print_query(const Point &query, int dim, int i)
+{
+    std::cout << "query " << i << ": (";
+    for (int d = 0; d < dim; ++d) { 
+        std::cout << query[d];
+        if (d + 1 < dim) std::cout << ", ";
+    }
+    std::cout << ")\n";
+}
+
+void print_result(const Point &pt, double distance, int dim)
+{
+    std::cout << "("; 
+    for (int d = 0; d < dim; ++d) {
+        std::cout << pt[d];
+        if (d + 1 < dim) std::cout << ", ";
+    }
+    std::cout << ") " << distance << "\n"; 
+}
+
 int main(int argc, char **argv)
 { 
     if (argc < 2) {
-        std::cout << "usage: knn <pts> [queries] [nn] [epsilon]" << std::endl;
+        std::cout << "usage: knn <pts> [queries] [nn] [epsilon] [threads]" << std::endl;
         exit(1);
     }
 
@@ -148,28 +177,82 @@ int main(int argc, char **argv)
 
     //read query epsilon
     double epsilon = 0.0;
-    if (argc == 5) epsilon = atof(argv[4]);
+    if (argc >= 5) epsilon = atof(argv[4]);
+
+    //batch mode: time queries one at a time against knn_batch and knn_join
+    if (argc >= 6) {
+        ThreadPool pool(atoi(argv[5]));
+
+        timeval start;
+        gettimeofday(&start, 0);
+        for (int i = 0; i < q_count; ++i) { 
+            kt.knn(nn, queries[i], epsilon);
+        }
+        double single = elapsed(start);
 
-    //run queries
-    for (int i = 0; i < q_count; ++i) { 
+        Point **ptrs = new Point *[q_count * nn];
+        double *dists = new double[q_count * nn];
 
-        std::list<std::pair<Point *, double> > qr = kt.knn(nn, queries[i], epsilon);  
+        gettimeofday(&start, 0);
+        kt.knn_batch(queries, q_count, nn, epsilon, ptrs, dists, &pool);
+        double batch = elapsed(start);
 
-        std::cout << "query " << i << ": (";
-        for (int d = 0; d < dim; ++d) { 
-            std::cout << queries[i][d];
-            if (d + 1 < dim) std::cout << ", ";
+        Point **join_ptrs = new Point *[q_count * nn];
+        double *join_dists = new double[q_count * nn];
+
+        gettimeofday(&start, 0);
+        kt.knn_join(queries, q_count, nn, epsilon, join_ptrs, join_dists, &pool);
+        double join = elapsed(start);
+
+        //exact searches must find neighbours at the same distances
+        int errors = 0;
+        for (int i = 0; epsilon == 0.0 && i < q_count * nn; ++i) {
+            if (dists[i] != join_dists[i]) ++errors;
+        }
+
+        if (errors) {
+            std::cerr << "error: knn_join and knn_batch disagree on ";
+            std::cerr << errors << " neighbours" << std::endl;
         }
-        std::cout << ")\n";
 
-        for (std::list<std::pair<Point *, double> >::iterator itor = qr.begin(); itor != qr.end(); ++itor) {
-            std::cout << "("; 
-            for (int d = 0; d < dim; ++d) {
-                std::cout << (*itor->first)[d];
-                if (d + 1 < dim) std::cout << ", ";
+        for (int i = 0; i < q_count; ++i) { 
+            print_query(queries[i], dim, i);
+            for (int j = 0; j < nn && ptrs[i * nn + j]; ++j) {
+                print_result(*ptrs[i * nn + j], dists[i * nn + j], dim);
             }
-            std::cout << ") " << itor->second << "\n"; 
-        } 
+        }
+
+        std::cerr << "single: " << q_count / single << " queries/s\n";
+        std::cerr << "batch (" << pool.size() << " threads): ";
+        std::cerr << q_count / batch << " queries/s" << std::endl;
+        std::cerr << "join (" << pool.size() << " threads): ";
+        std::cerr << q_count / join << " queries/s" << std::endl;
+
+        delete[] ptrs;
+        delete[] dists;
+        delete[] join_ptrs;
+        delete[] join_dists;
+
+        if (errors) return 1;
+    } else {
+
+        //run queries
+        KdTree<Point, double>::SearchContext ctx(pt_count);
+        KdTree<Point, double>::SearchStats stats;
+        ctx.stats = &stats;
+        for (int i = 0; i < q_count; ++i) { 
+
+            std::list<std::pair<Point *, double> > qr = kt.knn(ctx, nn, queries[i], epsilon);  
+
+            print_query(queries[i], dim, i);
+
+            for (std::list<std::pair<Point *, double> >::iterator itor = qr.begin(); itor != qr.end(); ++itor) {
+                print_result(*itor->first, itor->second, dim);
+            } 
+        }
+
+        std::cerr << "nodes visited: " << (double)stats.nodes_visited / q_count;
+        std::cerr << " per query" << std::endl;
     }
 
     std::cout << "done." << std::endl;
@@ -0,0 +1,193 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <list>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "kdtree.h"
+
+const size_t DIM = 3;
+
+struct Point {
+    double v[DIM];
+
+    double &operator[](size_t i) { return v[i]; }
+    const double &operator[](size_t i) const { return v[i]; }
+};
+
+typedef KdTree<Point, double, DIM> Tree;
+
+double elapsed(const timeval &start)
+{
+    timeval now;
+    gettimeofday(&now, 0);
+    return (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) * 1e-6;
+}
+
+//fills pts with uniform random points from a fixed seed
+void generate(std::vector<Point> &pts, unsigned long long state)
+{
+    for (size_t i = 0; i < pts.size(); ++i) {
+        for (size_t j = 0; j < DIM; ++j) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            pts[i][j] = (double)(state >> 11) / (double)(1ULL << 53);
+        }
+    }
+}
+
+//a hardware event counted for this thread, if the kernel allows it
+struct Counter {
+
+    Counter(unsigned int type, unsigned long long config)
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    ~Counter()
+    {
+        if (fd >= 0) close(fd);
+    }
+
+    long long read_value() const
+    {
+        long long value = 0;
+        if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) return -1;
+        return value;
+    }
+
+    long fd;
+};
+
+Counter cache_misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+Counter tlb_misses(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
+    | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+//times one kind of query over every query point, and returns a checksum of
+//the results so the layouts can be checked against each other
+struct Measure {
+
+    Measure(const char *name, size_t queries) : name(name), queries(queries)
+    {
+        misses = cache_misses.read_value();
+        tlb = tlb_misses.read_value();
+        gettimeofday(&start, 0);
+    }
+
+    void report(double checksum)
+    {
+        double seconds = elapsed(start);
+        long long m = cache_misses.read_value(), t = tlb_misses.read_value();
+
+        printf("  %-8s %8.0f ns/query", name, seconds * 1e9 / queries);
+        if (misses >= 0 && m >= 0) {
+            printf(", %6.1f cache misses", (double)(m - misses) / queries);
+        } else {
+            printf(",    n/a cache misses");
+        }
+        if (tlb >= 0 && t >= 0) {
+            printf(", %6.1f TLB misses", (double)(t - tlb) / queries);
+        } else {
+            printf(",    n/a TLB misses");
+        }
+        printf(" (checksum %.6g)\n", checksum);
+    }
+
+    const char *name;
+    size_t queries;
+    long long misses, tlb;
+    timeval start;
+};
+
+void run(size_t n, size_t nq, Tree::NodeLayout layout)
+{
+    std::vector<Point> pts(n), queries(nq);
+    generate(pts, 12345);
+    generate(queries, 67890);
+
+    Tree::Options options;
+    options.layout = layout;
+
+    timeval start;
+    gettimeofday(&start, 0);
+    Tree tree(DIM, &pts[0], n, options);
+    printf("%s, %lu points: build %.3fs\n",
+        layout == Tree::LAYOUT_PREORDER ? "preorder" : "van Emde Boas",
+        (unsigned long)n, elapsed(start));
+
+    double checksum = 0;
+    Measure locate("locate", nq);
+    for (size_t i = 0; i < nq; ++i) {
+        checksum += tree.locate(queries[i])->pt() - &pts[0];
+    }
+    locate.report(checksum);
+
+    Tree::SearchContext ctx(n);
+    size_t ks[] = {1, 16};
+    for (size_t j = 0; j < sizeof(ks) / sizeof(ks[0]); ++j) {
+        char name[16];
+        snprintf(name, sizeof(name), "knn %lu", (unsigned long)ks[j]);
+
+        checksum = 0;
+        Measure knn(name, nq);
+        for (size_t i = 0; i < nq; ++i) {
+            std::list<std::pair<Point *, double> > qr =
+                tree.knn(ctx, ks[j], queries[i], 0.0);
+            checksum += qr.back().second;
+        }
+        knn.report(checksum);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 1) {
+        printf("usage: layout-bench <points> [queries]\n");
+        printf("benchmarking the default size of 100M points\n");
+    }
+
+    size_t n = argc > 1 ? strtoul(argv[1], 0, 10) : 100000000;
+    size_t nq = argc > 2 ? strtoul(argv[2], 0, 10) : 1000000;
+
+    if (cache_misses.fd < 0) printf("hardware counters unavailable\n");
+
+    run(n, nq, Tree::LAYOUT_PREORDER);
+    run(n, nq, Tree::LAYOUT_VAN_EMDE_BOAS);
+
+    return 0;
+}
@@ -0,0 +1,184 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <sys/time.h>
+
+#include "kdtree.h"
+
+typedef double Point[2];
+typedef KdTree<Point, double> Tree;
+
+double elapsed(const timeval &start)
+{
+    timeval now;
+    gettimeofday(&now, 0);
+    return (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) * 1e-6;
+}
+
+Point *read_points(const char *filename, int &pt_count)
+{
+    FILE *f = fopen(filename, "r");
+
+    if (!f) {
+        printf("error: could not open points file: %s\n", filename);
+        exit(1);
+    }
+
+    int dim;
+    if (fscanf(f, "%d %d", &pt_count, &dim) != 2 || pt_count < 0 || dim != 2) {
+        printf("error: invalid header: %s\n", filename);
+        exit(1);
+    }
+
+    Point *pts = new Point[pt_count];
+
+    for (int i = 0; i < pt_count; ++i) {
+        fscanf(f, "%lf, %lf", &pts[i][0], &pts[i][1]);
+    }
+
+    fclose(f);
+
+    return pts;
+}
+
+//checks that the mapped tree answers every query exactly as the built one
+int compare(const Tree &built, const Tree &mapped, Point *queries, int q_count)
+{
+    int errors = 0;
+
+    for (int i = 0; i < q_count; ++i) {
+
+        std::list<std::pair<Point *, double> > a = built.knn(3, queries[i], 0.0);
+        std::list<std::pair<Point *, double> > b = mapped.knn(3, queries[i], 0.0);
+
+        std::list<std::pair<Point *, double> >::iterator ai = a.begin(), bi = b.begin();
+        for (; ai != a.end() && bi != b.end(); ++ai, ++bi) {
+            if ((*ai->first)[0] != (*bi->first)[0] || (*ai->first)[1] != (*bi->first)[1]
+                || ai->second != bi->second) break;
+        }
+
+        if (a.size() != b.size() || ai != a.end()) {
+            printf("error: knn differs for query %d\n", i + 1);
+            ++errors;
+        }
+
+        double range[4] = {queries[i][0] - 50, queries[i][0] + 50,
+            queries[i][1] - 50, queries[i][1] + 50};
+
+        if (built.range_count(range) != mapped.range_count(range)
+            || built.range_search(range).size() != mapped.range_search(range).size()) {
+            printf("error: range query differs for query %d\n", i + 1);
+            ++errors;
+        }
+    }
+
+    //a join builds its query tree with the options the tree was built with
+    const size_t k = 3;
+    Point **built_ptrs = new Point *[q_count * k];
+    Point **mapped_ptrs = new Point *[q_count * k];
+    double *built_dists = new double[q_count * k];
+    double *mapped_dists = new double[q_count * k];
+
+    ThreadPool pool(2);
+    built.knn_join(queries, q_count, k, 0.0, built_ptrs, built_dists, &pool);
+    mapped.knn_join(queries, q_count, k, 0.0, mapped_ptrs, mapped_dists, &pool);
+
+    for (int i = 0; i < q_count * (int)k; ++i) {
+        if (built_dists[i] != mapped_dists[i]) {
+            printf("error: knn join differs for query %d\n", i / (int)k + 1);
+            ++errors;
+            break;
+        }
+    }
+
+    delete[] built_ptrs;
+    delete[] mapped_ptrs;
+    delete[] built_dists;
+    delete[] mapped_dists;
+
+    return errors;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        printf("usage: mapped_tree <pts> <tree file> [random points]\n");
+        exit(1);
+    }
+
+    int pt_count;
+    Point *pts = read_points(argv[1], pt_count);
+
+    //optionally time a larger random set instead
+    if (argc >= 4) {
+        delete[] pts;
+        pt_count = atoi(argv[3]);
+        pts = new Point[pt_count];
+        for (int i = 0; i < pt_count; ++i) {
+            pts[i][0] = rand() % 100000;
+            pts[i][1] = rand() % 100000;
+        }
+    }
+
+    //queries are the points themselves, before the build reorders them
+    Point *queries = new Point[pt_count];
+    for (int i = 0; i < pt_count; ++i) {
+        queries[i][0] = pts[i][0];
+        queries[i][1] = pts[i][1];
+    }
+
+    timeval start;
+    gettimeofday(&start, 0);
+    Tree::Options options;
+    options.bucket_size = 8;
+    options.split = Tree::SPLIT_SLIDING_MIDPOINT;
+    Tree built(2, pts, pt_count, options);
+    double build_time = elapsed(start);
+
+    if (!built.save(argv[2])) {
+        printf("error: could not save tree: %s\n", argv[2]);
+        exit(1);
+    }
+
+    gettimeofday(&start, 0);
+    Tree *mapped = Tree::open_mapped(argv[2]);
+    double open_time = elapsed(start);
+
+    if (!mapped) {
+        printf("error: could not map tree: %s\n", argv[2]);
+        exit(1);
+    }
+
+    int errors = compare(built, *mapped, queries, std::min(pt_count, 10000));
+
+    fprintf(stderr, "%d points: build %.3f ms, open %.3f ms\n", pt_count,
+        build_time * 1e3, open_time * 1e3);
+
+    delete mapped;
+    delete[] pts;
+    delete[] queries;
+
+    return errors ? -1 : 0;
+}
@@ -21,26 +21,400 @@ THE SOFTWARE.
 */
 
 #include <cstdio>
+#include <cstdlib>
 
+#include <sys/time.h>
+
+#include <queue>
+#include <vector>
+
+#include "kdtree.h"
 #include "priority_queue.h"
+#include "top_k.h"
+
+const size_t DIM = 3;
+
+typedef double Point[DIM];
+typedef KdTree<Point, double> Tree;
+
+//the binary heap this replaced, kept to compare against
+namespace previous {
+
+template<class T> class PriorityQueue {
+
+public:
+
+    struct Entry {
+        double priority;
+        T data;
+    };
+
+    PriorityQueue(int size) : length(0), size(size)
+    {
+        entries = new Entry[size + 1];
+    }
+
+    virtual ~PriorityQueue()
+    {
+        delete[] entries;
+    }
+
+    void push(double priority, const T &data)
+    {
+        ++length;
+
+        if (length == size) {
+            size_t new_size = size << 1;
+            Entry *new_entries = new Entry[new_size + 1];
+            for (size_t i = 1; i < length; ++i) {
+                new_entries[i] = entries[i];
+            }
+
+            delete[] entries;
+            entries = new_entries;
+            size = new_size;
+        }
+
+        entries[length].priority = priority;
+        entries[length].data = data;
+
+        size_t i = length;
+        size_t parent = i >> 1;
+        while (i != 1 && entries[i].priority > entries[parent].priority) {
+            Entry t = entries[i];
+            entries[i] = entries[parent];
+            entries[parent] = t;
+
+            i = parent;
+            parent = i >> 1;
+        }
+    }
+
+    Entry pop()
+    {
+        Entry min = entries[1];
+        entries[1] = entries[length];
+        --length;
+        heapify(1);
+
+        return min;
+    }
+
+    void clear()
+    {
+        length = 0;
+    }
+
+    size_t length;
+
+private:
+
+    Entry *entries;
+    size_t size;
 
-const int QUEUE_SIZE = 5;
-const int TEST_SIZE = 10;
+    void heapify(size_t i)
+    {
+        size_t l = i << 1;
+        size_t r = l + 1;
+        size_t smallest = i;
+
+        if (l <= length && entries[l].priority > entries[i].priority) {
+            smallest = l;
+        }
+
+        if (r <= length && entries[r].priority > entries[smallest].priority) {
+            smallest = r;
+        }
+
+        if (smallest != i) {
+            Entry t = entries[i];
+            entries[i] = entries[smallest];
+            entries[smallest] = t;
+
+            heapify(smallest);
+        }
+    }
+};
+
+}
+
+double elapsed(const timeval &start)
+{
+    timeval now;
+    gettimeofday(&now, 0);
+    return (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) * 1e-6;
+}
+
+//interleaves pushes and pops, growing from a tiny initial size and reusing
+//the queue after clear(), and checks the pops against std::priority_queue
+template<class Queue> int check_queue(const char *name)
+{
+    Queue pq(1);
+    std::priority_queue<double> expected;
+
+    for (int round = 0; round < 3; ++round) {
+        for (int i = 0; i < 20000; ++i) {
+            if (rand() % 3 || !expected.size()) {
+                double priority = rand() % 1000;
+                pq.push(priority, i);
+                expected.push(priority);
+            } else if (pq.pop().priority != expected.top()) {
+                printf("error: %s popped out of order\n", name);
+                return 1;
+            } else {
+                expected.pop();
+            }
+
+            if (pq.length != expected.size()) {
+                printf("error: %s holds %d entries not %d\n", name,
+                    (int)pq.length, (int)expected.size());
+                return 1;
+            }
+        }
+
+        //drain half, then start the next round on a cleared queue
+        while (expected.size() > 10000) {
+            if (pq.pop().priority != expected.top()) {
+                printf("error: %s popped out of order\n", name);
+                return 1;
+            }
+            expected.pop();
+        }
+
+        pq.clear();
+        expected = std::priority_queue<double>();
+    }
+
+    return 0;
+}
+
+//checks a copy pops the same entries as the queue it was copied from
+template<size_t Arity> int check_copy()
+{
+    PriorityQueue<int, Arity> pq(4);
+    for (int i = 0; i < 1000; ++i) pq.push(rand() % 100, i);
+
+    PriorityQueue<int, Arity> copy(pq);
+    PriorityQueue<int, Arity> assigned(1);
+    assigned = pq;
+
+    while (pq.length) {
+        double priority = pq.pop().priority;
+        if (copy.pop().priority != priority || assigned.pop().priority != priority) {
+            printf("error: copy of arity %d heap popped out of order\n", (int)Arity);
+            return 1;
+        }
+    }
+
+    return copy.length || assigned.length;
+}
+
+//the frontier of Tree::knn_search written against the public node
+//interface, so that the same search can be run over each queue
+template<class Queue> void knn(const Tree &tree, Queue &searchpq,
+    TopK<Point *> &resultpq, const Point &pt)
+{
+    resultpq.clear();
+    searchpq.clear();
+    searchpq.push(0, tree.root);
+
+    while (searchpq.length) {
+        typename Queue::Entry entry = searchpq.pop();
+        Tree::Node *node = entry.data;
+        double cell_distance = -entry.priority;
+
+        if (resultpq.full() && cell_distance >= resultpq.peek().priority) break;
+
+        while (node) {
+            Point *p = node->pt();
+            Point *end = p + node->stored();
+            for (; p != end; ++p) {
+                double distance = 0;
+                for (size_t d = 0; d < DIM; ++d) {
+                    distance += (pt[d] - (*p)[d]) * (pt[d] - (*p)[d]);
+                }
+                if (!resultpq.full() || distance < resultpq.peek().priority) {
+                    resultpq.push(distance, p);
+                }
+            }
+
+            if (node->leaf()) break;
+
+            double q = pt[node->axis];
+            double cut = q - node->median;
+            double offset = q < node->lo ? node->lo - q
+                : q > node->hi ? q - node->hi : 0;
+            double far_distance = cell_distance + cut*cut - offset*offset;
+
+            Tree::Node *near_child = cut < 0 ? node->left() : node->right();
+            Tree::Node *far_child = cut < 0 ? node->right() : node->left();
+
+            if (far_child && (!resultpq.full()
+                || far_distance < resultpq.peek().priority)) {
+                searchpq.push(-far_distance, far_child);
+            }
+
+            node = near_child;
+        }
+    }
+}
+
+//records the pushes and pops knn makes, to replay against each queue with
+//the cost of the search itself taken out. priorities are negated
+//distances, so positive values are free to mark the other operations.
+const double TRACE_POP = 1;
+const double TRACE_CLEAR = 2;
+
+struct RecordingQueue : public previous::PriorityQueue<Tree::Node *> {
+
+    RecordingQueue(std::vector<double> &trace)
+        : previous::PriorityQueue<Tree::Node *>(32), trace(trace)
+    {
+    }
+
+    void push(double priority, Tree::Node *node)
+    {
+        trace.push_back(priority);
+        previous::PriorityQueue<Tree::Node *>::push(priority, node);
+    }
+
+    Entry pop()
+    {
+        trace.push_back(TRACE_POP);
+        return previous::PriorityQueue<Tree::Node *>::pop();
+    }
+
+    void clear()
+    {
+        trace.push_back(TRACE_CLEAR);
+        previous::PriorityQueue<Tree::Node *>::clear();
+    }
+
+    std::vector<double> &trace;
+};
+
+template<class Queue> void replay(const char *name,
+    const std::vector<double> &trace, int query_count)
+{
+    Queue pq(32);
+
+    timeval start;
+    gettimeofday(&start, 0);
+
+    //repeat the trace so that the queue dominates the timing
+    double checksum = 0;
+    const int repeats = 20;
+    for (int r = 0; r < repeats; ++r) {
+        for (size_t i = 0; i < trace.size(); ++i) {
+            if (trace[i] == TRACE_POP) {
+                checksum += pq.pop().priority;
+            } else if (trace[i] == TRACE_CLEAR) {
+                pq.clear();
+            } else {
+                pq.push(trace[i], 0);
+            }
+        }
+    }
+
+    double seconds = elapsed(start);
+    printf("  %-10s %10.1f ns/query (%g)\n", name,
+        seconds * 1e9 / ((double)query_count * repeats), checksum);
+}
+
+//runs the queries through knn with one queue type, returning the sum of
+//the furthest neighbour distances so the heaps can be checked against
+//each other
+template<class Queue> double bench(const char *name, const Tree &tree,
+    Point *queries, int query_count, size_t k)
+{
+    Queue searchpq(32);
+    TopK<Point *> resultpq(k);
+
+    timeval start;
+    gettimeofday(&start, 0);
+
+    double checksum = 0;
+    for (int i = 0; i < query_count; ++i) {
+        knn(tree, searchpq, resultpq, queries[i]);
+        checksum += resultpq.peek().priority;
+    }
+
+    double seconds = elapsed(start);
+    printf("  %-10s k=%-4d %10.0f queries/s\n", name, (int)k,
+        query_count / seconds);
+
+    return checksum;
+}
 
 int main(int argc, char **argv)
 {
-    PriorityQueue<int> pq(QUEUE_SIZE);
+    int pt_count = argc > 1 ? atoi(argv[1]) : 300000;
+    int query_count = argc > 2 ? atoi(argv[2]) : 30000;
 
-    for (int i = 0; i < TEST_SIZE; ++i) {
-        double priority = (double)rand()/(double)RAND_MAX;
-        printf("inserting: %f %i\n", priority, i);
-        pq.push(priority, i);
+    if (pt_count < 100 || query_count < 1) {
+        fprintf(stderr, "usage: priority-queue [points] [queries]\n");
+        return 1;
     }
 
-    while(pq.length) {
-        PriorityQueue<int>::Entry e = pq.pop();
-        printf("%f %d\n", e.priority, e.data);
+    int failures = 0;
+    failures += check_queue<previous::PriorityQueue<int> >("previous");
+    failures += check_queue<PriorityQueue<int, 2> >("arity 2");
+    failures += check_queue<PriorityQueue<int, 4> >("arity 4");
+    failures += check_queue<PriorityQueue<int, 8> >("arity 8");
+    failures += check_copy<2>() + check_copy<4>() + check_copy<8>();
+    if (failures) return 1;
+
+    Point *pts = new Point[pt_count];
+    for (int i = 0; i < pt_count; ++i) {
+        for (size_t d = 0; d < DIM; ++d) pts[i][d] = (double)rand() / RAND_MAX;
+    }
+
+    Point *queries = new Point[query_count];
+    for (int i = 0; i < query_count; ++i) {
+        for (size_t d = 0; d < DIM; ++d) queries[i][d] = (double)rand() / RAND_MAX;
     }
 
+    Tree tree(DIM, pts, pt_count);
+
+    printf("knn over %d uniform points in %d dimensions, %d queries\n",
+        pt_count, (int)DIM, query_count);
+
+    size_t ks[] = {1, 10, 100};
+    for (size_t i = 0; i < sizeof(ks) / sizeof(*ks); ++i) {
+        double expected = bench<previous::PriorityQueue<Tree::Node *> >(
+            "previous", tree, queries, query_count, ks[i]);
+
+        double checksums[] = {
+            bench<PriorityQueue<Tree::Node *, 2> >("arity 2", tree, queries, query_count, ks[i]),
+            bench<PriorityQueue<Tree::Node *, 4> >("arity 4", tree, queries, query_count, ks[i]),
+            bench<PriorityQueue<Tree::Node *, 8> >("arity 8", tree, queries, query_count, ks[i])
+        };
+
+        for (size_t j = 0; j < sizeof(checksums) / sizeof(*checksums); ++j) {
+            if (checksums[j] != expected) {
+                printf("error: knn results differ between queues\n");
+                return 1;
+            }
+        }
+    }
+
+    printf("frontier operations of the same searches replayed alone\n");
+    for (size_t i = 0; i < sizeof(ks) / sizeof(*ks); ++i) {
+        std::vector<double> trace;
+        RecordingQueue recorder(trace);
+        TopK<Point *> resultpq(ks[i]);
+        for (int q = 0; q < query_count; ++q) knn(tree, recorder, resultpq, queries[q]);
+
+        printf(" k=%d, %.1f operations/query\n", (int)ks[i],
+            (double)trace.size() / query_count);
+        replay<previous::PriorityQueue<Tree::Node *> >("previous", trace, query_count);
+        replay<PriorityQueue<Tree::Node *, 2> >("arity 2", trace, query_count);
+        replay<PriorityQueue<Tree::Node *, 4> >("arity 4", trace, query_count);
+        replay<PriorityQueue<Tree::Node *, 8> >("arity 8", trace, query_count);
+    }
+
+    delete[] queries;
+    delete[] pts;
+
     return 0;
 }
@@ -0,0 +1,149 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <vector>
+
+#include "kdtree.h"
+
+const size_t DIM = 3;
+
+typedef double Point[DIM];
+typedef KdTree<Point, double> Tree;
+
+struct CountVisitor {
+    CountVisitor() : count(0) {}
+    void operator()(Point *) { ++count; }
+    size_t count;
+};
+
+double distance(const Point &a, const Point &b)
+{
+    double distance = 0;
+    for (size_t d = 0; d < DIM; ++d) distance += (a[d] - b[d]) * (a[d] - b[d]);
+    return distance;
+}
+
+std::vector<Point *> linear_radius_query(int pt_count, Point *pts, const Point &query, double r)
+{
+    std::vector<Point *> qr;
+
+    for (int i = 0; i < pt_count; ++i) {
+        if (distance(pts[i], query) <= r * r) qr.push_back(&pts[i]);
+    }
+
+    return qr;
+}
+
+//compares radius_search, radius_count and radius_visit against a linear scan
+int check(Tree &tree, int pt_count, Point *pts, const Point &query, double r)
+{
+    std::vector<Point *> lqr = linear_radius_query(pt_count, pts, query, r);
+
+    std::vector<Point *> kqr = tree.radius_search(query, r);
+    size_t kqr_count = tree.radius_count(query, r);
+
+    CountVisitor visitor;
+    tree.radius_visit(query, r, visitor);
+
+    //every point reported must be within the ball, each at most once
+    std::vector<bool> seen(pt_count, false);
+    for (size_t i = 0; i < kqr.size(); ++i) {
+        size_t index = kqr[i] - pts;
+        if (seen[index] || distance(*kqr[i], query) > r * r) {
+            printf("error: kdtree reported point %d wrongly\n", (int)index);
+            return 1;
+        }
+        seen[index] = true;
+    }
+
+    if (kqr.size() != lqr.size() || kqr_count != lqr.size() || visitor.count != lqr.size()) {
+        printf("error: kdtree and linear do not agree for radius %.1f about (%.1f, %.1f, %.1f)\n",
+            r, query[0], query[1], query[2]);
+        printf("(kdtree) found %d, counted %d, visited %d points...\n",
+            (int)kqr.size(), (int)kqr_count, (int)visitor.count);
+        printf("(linear) found %d points...\n", (int)lqr.size());
+        return 1;
+    }
+
+    //counting the work must not change the answer, and apart from the
+    //root every node visited is a subtree the query crossed into
+    Tree::SearchStats stats;
+    size_t counted = tree.radius_count(query, r, &stats);
+    size_t roots = stats.nodes_visited ? 1 : 0;
+    if (counted != kqr_count || stats.nodes_visited != stats.intersected + roots) {
+        printf("error: radius_count with stats found %d points in %d nodes, "
+            "crossing into %d subtrees\n", (int)counted,
+            (int)stats.nodes_visited, (int)stats.intersected);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && atoi(argv[1]) <= 0) {
+        printf("usage: radius_query [points] [queries]\n");
+        exit(1);
+    }
+
+    int pt_count = argc > 1 ? atoi(argv[1]) : 20000;
+    int q_count = argc > 2 ? atoi(argv[2]) : 500;
+
+    //points on a coarse grid so that many lie exactly on the query spheres
+    Point *pts = new Point[pt_count];
+    for (int i = 0; i < pt_count; ++i) {
+        for (size_t d = 0; d < DIM; ++d) pts[i][d] = rand() % 50;
+    }
+
+    const double radii[] = {0.0, 1.0, 5.0, 13.0, 25.0, 100.0};
+    const size_t radius_count = sizeof(radii) / sizeof(radii[0]);
+
+    int errors = 0;
+
+    const size_t buckets[] = {1, 8};
+    for (size_t b = 0; b < 4; ++b) {
+        for (int copy = 0; copy < 2; ++copy) {
+            Tree::Options options;
+            options.bucket_size = buckets[b % 2];
+            options.copy_coords = copy;
+            options.layout = b < 2 ? Tree::LAYOUT_PREORDER : Tree::LAYOUT_VAN_EMDE_BOAS;
+
+            Tree tree(DIM, pts, pt_count, options);
+
+            for (int i = 0; i < q_count; ++i) {
+                Point query;
+                for (size_t d = 0; d < DIM; ++d) query[d] = rand() % 60 - 5;
+
+                errors += check(tree, pt_count, pts, query, radii[i % radius_count]);
+                if (errors) break;
+            }
+        }
+    }
+
+    delete[] pts;
+
+    return errors ? -1 : 0;
+}
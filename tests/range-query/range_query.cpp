@@ -35,6 +35,12 @@ static int point_in_range(Point *p, double *range, size_t dim)
     return 1; 
 } 
 
+struct CountVisitor {
+    CountVisitor() : count(0) {}
+    void operator()(Point *) { ++count; }
+    size_t count;
+};
+
 std::vector<Point *> linear_range_query(int pt_count, Point *pts, double *range)
 { 
     std::vector<Point *> qr;
@@ -109,12 +115,23 @@ int main(int argc, char **argv)
     KdTree<Point, double> kt(2, pts, pt_count);
 
     //run queries
+    std::vector<Point *> kqr;
     for (int i = 0; i < q_count; ++i) { 
 
-        std::vector<Point *> kqr = kt.range_search(&ranges[i*4]);  
+        kqr.clear();
+        kt.range_search(&ranges[i*4], kqr);
         size_t kqr_count = kt.range_count(&ranges[i*4]);  
         std::vector<Point *> lqr = linear_range_query(pt_count, pts, &ranges[i*4]);  
 
+        CountVisitor visitor;
+        kt.range_visit(&ranges[i*4], visitor);
+
+        if (lqr.size() != visitor.count) {
+            printf("error: kdtree and linear do not agree for visit on query %d\n", i + 1);
+            printf("(kdtree) visited %d points...\n", (int)visitor.count);
+            printf("(linear) found %d points...\n", (int)lqr.size());
+        }
+
         if (lqr.size() != kqr_count) {
             printf("error: kdtree and linear do not agree for count on query %d\n", i + 1);
             printf("range: %.1f %.1f %.1f %.1f\n", ranges[i*4], ranges[i*4+1], ranges[i*4+2], ranges[i*4+3]);
@@ -34,9 +34,11 @@ void render_tree(FILE *f, struct KdTree<Point, double>::Node *tree,
     //check for empty branch
     if (!tree) return;
 
-    if (!tree->children) {
+    if (tree->leaf()) {
         //leaf
-        fprintf(stdout, "%.0f %.0f draw-point\n", (*tree->pt)[0], (*tree->pt)[1]);
+        for (unsigned int i = 0; i < tree->stored(); ++i) {
+            fprintf(stdout, "%.0f %.0f draw-point\n", tree->pt()[i][0], tree->pt()[i][1]);
+        }
     } else { 
         //branch 
         if (depth < 1) fprintf(stdout, "4 setlinewidth\n");
@@ -44,7 +46,7 @@ void render_tree(FILE *f, struct KdTree<Point, double>::Node *tree,
         else if (depth < 4) fprintf(stdout, "2 setlinewidth\n");
         else fprintf(stdout, "1 setlinewidth\n");
 
-        if (depth % 2 == 1) {
+        if (tree->axis == 1) {
             fprintf(stdout, "%.0f %.0f %.0f h-line\n", x1, x2, tree->median);
             render_tree(f, tree->left(), depth + 1, x1, x2, y1, tree->median);
             render_tree(f, tree->right(), depth + 1, x1, x2, tree->median, y2);
@@ -54,7 +56,7 @@ void render_tree(FILE *f, struct KdTree<Point, double>::Node *tree,
             render_tree(f, tree->right(), depth + 1, tree->median, x2, y1, y2);
         }
 
-        fprintf(stdout, "%.0f %.0f draw-point\n", (*tree->pt)[0], (*tree->pt)[1]);
+        fprintf(stdout, "%.0f %.0f draw-point\n", (*tree->pt())[0], (*tree->pt())[1]);
     }
 }
 
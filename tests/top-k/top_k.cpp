@@ -0,0 +1,158 @@
+/*
+Copyright (c) 2012 Daniel Minor
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <vector>
+
+#include "kdtree.h"
+#include "top_k.h"
+
+const size_t DIM = 3;
+
+typedef double Point[DIM];
+typedef KdTree<Point, double> Tree;
+
+//pushes random priorities, with many ties, and checks the k smallest come
+//back out furthest first
+template<class Collector> int check_collector(Collector &collector, size_t k)
+{
+    std::vector<double> pushed;
+    for (int i = 0; i < 1000; ++i) {
+        double priority = rand() % 300;
+        pushed.push_back(priority);
+        collector.push(priority, i);
+    }
+
+    std::sort(pushed.begin(), pushed.end());
+    size_t expected = std::min(k, pushed.size());
+
+    if (collector.length != expected) {
+        printf("error: top %d kept %d entries\n", (int)k, (int)collector.length);
+        return 1;
+    }
+
+    for (size_t i = expected; i-- > 0; ) {
+        if (collector.pop().priority != pushed[i]) {
+            printf("error: top %d popped the wrong entry\n", (int)k);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+//checks knn finds neighbours at the same distances as a linear scan, which
+//on a coarse grid means keeping distinct points at equal distances
+int check_knn(Tree &tree, Tree::SearchContext &ctx, int pt_count, Point *pts,
+    const Point &query, size_t k)
+{
+    std::vector<double> distances;
+    for (int i = 0; i < pt_count; ++i) {
+        double distance = 0;
+        for (size_t d = 0; d < DIM; ++d) {
+            distance += (pts[i][d] - query[d]) * (pts[i][d] - query[d]);
+        }
+        distances.push_back(distance);
+    }
+    std::sort(distances.begin(), distances.end());
+    distances.resize(std::min(k, distances.size()));
+
+    std::list<std::pair<Point *, double> > qr = tree.knn(ctx, k, query, 0.0);
+
+    std::vector<Point *> found;
+    size_t i = 0;
+    for (std::list<std::pair<Point *, double> >::iterator itor = qr.begin();
+        itor != qr.end(); ++itor, ++i) {
+        if (i >= distances.size() || itor->second != distances[i]) break;
+        found.push_back(itor->first);
+    }
+
+    std::sort(found.begin(), found.end());
+    bool unique = std::unique(found.begin(), found.end()) == found.end();
+
+    if (qr.size() != distances.size() || i != qr.size() || !unique) {
+        printf("error: %s knn for k = %d about (%.0f, %.0f, %.0f) found %d "
+            "neighbours, %d of them right, expected %d\n",
+            ctx.traversal == Tree::KNN_DEPTH_FIRST ? "depth first" : "best first",
+            (int)k, query[0], query[1], query[2], (int)qr.size(), (int)i,
+            (int)distances.size());
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int errors = 0;
+
+    for (size_t k = 0; k <= 100; k += 3) {
+        TopK<int> collector(k);
+        errors += check_collector(collector, k);
+    }
+
+    TopK<int, 1> one;
+    errors += check_collector(one, 1);
+    TopK<int, 8> sorted;
+    errors += check_collector(sorted, 8);
+    TopK<int, 64> heap;
+    errors += check_collector(heap, 64);
+
+    //points on a coarse grid so that many neighbours are equidistant
+    int pt_count = 5000;
+    Point *pts = new Point[pt_count];
+    for (int i = 0; i < pt_count; ++i) {
+        for (size_t d = 0; d < DIM; ++d) pts[i][d] = rand() % 10;
+    }
+
+    //both traversals, over balanced trees and the unbalanced trees of
+    //sliding midpoint splits, whose depth first stacks are deepest
+    const size_t ks[] = {0, 1, 5, 40, 200};
+    const size_t buckets[] = {1, 8};
+    const Tree::SplitRule splits[] = {Tree::SPLIT_CYCLE, Tree::SPLIT_SLIDING_MIDPOINT};
+    const Tree::KnnTraversal traversals[] = {Tree::KNN_BEST_FIRST, Tree::KNN_DEPTH_FIRST};
+    for (size_t b = 0; b < 4; ++b) {
+        Tree::Options options;
+        options.bucket_size = buckets[b % 2];
+        options.split = splits[b / 2];
+        Tree tree(DIM, pts, pt_count, options);
+
+        for (size_t t = 0; t < 2; ++t) {
+            Tree::SearchContext ctx;
+            ctx.traversal = traversals[t];
+
+            for (int i = 0; i < 200 && !errors; ++i) {
+                Point query;
+                for (size_t d = 0; d < DIM; ++d) query[d] = rand() % 12 - 1;
+
+                errors += check_knn(tree, ctx, pt_count, pts, query, ks[i % 5]);
+            }
+        }
+    }
+
+    delete[] pts;
+
+    return errors ? -1 : 0;
+}